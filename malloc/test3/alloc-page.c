@@ -1,723 +1,3004 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
 #include <stdatomic.h>
 #include <stdbool.h>
 
 #ifndef BADGEROS_KERNEL
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <time.h>
 #endif
 
 #include "allocator.h"
 #include "quickpool.h"
+#include "pagecache.h"
 
 #define SKIPLIST_MAX_LEVEL 10
 #define RANGE_MAGIC 0XC0DECAFE
 
+// With OFF_PAGE_FREE_LISTS the nodes of free ranges and the quickpool links
+// live in arrays indexed by page next to the page table, rather than in the
+// free pages themselves. Free pages stay untouched and can be purged whole,
+// at the cost of sizeof(range_node_t) + sizeof(node_t) bytes of metadata per page.
+#ifdef OFF_PAGE_FREE_LISTS
+typedef atomic_uint_least32_t range_link_t; // Page index + 1 of the node, shard heads get RANGE_LINK_HEAD
+#define RANGE_LINK_HEAD  ((size_t)1 << 31)
+#define RANGE_NODE_PAGES 0
+#else
+typedef atomic_uintptr_t range_link_t;      // Address of the node
+#define RANGE_NODE_PAGES 1                  // Pages at the start of a free range its node takes up
+#endif
+
 // These are kind of large, but they exist in free memory
 typedef struct {
     atomic_uint_least32_t magic; // Used as a flag to prevent double use
     atomic_uint_least32_t level; // The current level of the node
     atomic_size_t start;         // Start of this range (as a page index)
     atomic_size_t size;          // Number of pages in this range
-    atomic_uintptr_t next[SKIPLIST_MAX_LEVEL]; // Forward pointers for coalescing skiplist
-    atomic_uintptr_t prev[SKIPLIST_MAX_LEVEL]; // Back pointers for coalescing skiplist
-    atomic_uintptr_t next_size[SKIPLIST_MAX_LEVEL]; // Forward pointers for size skiplist
-    atomic_uintptr_t prev_size[SKIPLIST_MAX_LEVEL]; // Back pointers for size skiplist
+    range_link_t next[SKIPLIST_MAX_LEVEL]; // Forward pointers for coalescing skiplist
+    range_link_t prev[SKIPLIST_MAX_LEVEL]; // Back pointers for coalescing skiplist
+    range_link_t next_size[SKIPLIST_MAX_LEVEL]; // Forward pointers for size skiplist
+    range_link_t prev_size[SKIPLIST_MAX_LEVEL]; // Back pointers for size skiplist
     atomic_uint_least32_t alloc_count;
     atomic_uint_least32_t dealloc_count;
+    atomic_size_t epoch;         // Purge epoch the range was freed in, merged ranges keep the older one
+    range_link_t next_bin;       // Next range in the same size bin
+    range_link_t prev_bin;       // Previous range in the same size bin, NULL for the first one
+    atomic_uint_least32_t bin;   // Size bin the range is filed in
+    atomic_flag lock;            // Held by whoever changes the links, size or bin of this node
 } range_node_t;
 
+// Free ranges are striped by address, every shard is an independent skiplist.
+// Ranges never cross a shard boundary, runs that do are stitched together by
+// locking the ranges involved.
+#define FREE_RANGE_SHARDS QUICKPOOL_DIVISIONS
+
+// Every memory region gets a fixed window of page indices, the region is
+// the upper bits of an index and the page within it the lower bits. Both
+// together have to fit the page index a quickpool head can hold.
+#if BITMAP_WORD_BITS == 64
+#define PAGE_REGIONS           16
+#define PAGE_REGION_INDEX_BITS 26
+#else
+#define PAGE_REGIONS           8
+#define PAGE_REGION_INDEX_BITS 16
+#endif
+#define PAGE_REGION_MAX_PAGES ((size_t)1 << PAGE_REGION_INDEX_BITS)
+#define PAGE_REGION_MASK      (PAGE_REGION_MAX_PAGES - 1)
+
+#ifndef BADGEROS_KERNEL
+#include <assert.h>
+
+static_assert(((size_t)PAGE_REGIONS << PAGE_REGION_INDEX_BITS) < ((size_t)1 << QUICKPOOL_INDEX_BITS), "Page indices must fit into a quickpool head");
+#endif
+
+// Next to the size skiplist every shard files its ranges into TLSF style
+// size bins. A first level covers a power of two of sizes, split up into
+// FREE_RANGE_BIN_SUBS second level bins, the smallest sizes get a bin each.
+// Every range in a bin above the one a request rounds up to fits it.
+#define FREE_RANGE_BIN_SUB_BITS 3
+#define FREE_RANGE_BIN_SUBS     (1 << FREE_RANGE_BIN_SUB_BITS)
+#define FREE_RANGE_BIN_LEVELS   (PAGE_REGION_INDEX_BITS - FREE_RANGE_BIN_SUB_BITS + 2)
+
+#ifndef BADGEROS_KERNEL
+static_assert(FREE_RANGE_BIN_LEVELS <= BITMAP_WORD_BITS, "Every first level bin needs a bit in a bitmap word");
+#endif
+
 typedef struct {
-    range_node_t head;
-    atomic_flag write_lock;     // We can support arbitarily many readers, but only one writer
+    range_node_t head;          // Has a lock like every node, writers don't lock the list as a whole
+    size_t first;               // First page index this list covers
+    size_t end;                 // One past the last page index this list covers
+    atomic_size_t largest_size; // Size of the tail of the size list, written under the tail's lock
+    atomic_size_t head_run;     // Size of the range starting at first, written under its lock
+    atomic_size_t tail_run;     // Size of the range ending at end, written under its lock
+    bitmap_word_atomic bin_levels;                      // Bit per first level with a range in any of its bins
+    bitmap_word_atomic bin_subs[FREE_RANGE_BIN_LEVELS]; // Bit per second level bin with a range in it, set under the bin lock
+    atomic_flag bin_locks[FREE_RANGE_BIN_LEVELS][FREE_RANGE_BIN_SUBS]; // Only held for the few stores filing a range in or out
+    range_node_t *bins[FREE_RANGE_BIN_LEVELS][FREE_RANGE_BIN_SUBS];
 } skiplist_t;
 
-size_t              quickpool_segment_size;
-uint8_t            *mem_start;
+// Two level bitmap with one bit per page of a region, a summary bit covers
+// one word and is set while any bit in that word is set
+typedef struct {
+    bitmap_word_atomic *words;
+    bitmap_word_atomic *summary;
+} page_bitmap_t;
+
+typedef struct {
+    uint8_t  *pages_start;
+    uint8_t  *pages_end;
+    size_t    pages;
+    size_t    shard_pages;
+    uint8_t  *page_table;
+    uint32_t *link_sizes; // Length of each page link, only valid for its head page
+    page_bitmap_t used;                   // Set while the page is handed out
+    page_bitmap_t types[ALLOCATOR_TYPES]; // Set while the page is handed out as that type
+    page_bitmap_t clean;                  // Set while the free page is handed back to the OS and untouched since
+    page_bitmap_t written;                // Set while the page may hold anything but zeros
+    bool          purge_zeroes;           // Purged pages read as zero
+#ifdef OFF_PAGE_FREE_LISTS
+    range_node_t *range_nodes;            // Node of the free range starting at each page
+    node_t       *quickpool_nodes;        // Quickpool link of each page
+#endif
+} page_region_t;
 
 static atomic_size_t       free_pages;
-static atomic_flag         alloc_lock = ATOMIC_FLAG_INIT; // If quickpools are full
+static atomic_flag         alloc_locks[QUICKPOOL_DIVISIONS] = {0}; // One quickpool refill per home division at a time
 static quickpool_t         quickpools[QUICKPOOL_TOTAL] = {0};
-static skiplist_t          free_ranges = { .head = {0}, .write_lock = ATOMIC_FLAG_INIT };
+static skiplist_t          free_ranges[PAGE_REGIONS * FREE_RANGE_SHARDS] = {0};
+static page_cache_t        page_caches[PAGE_CACHE_CPUS] = {0};
+static atomic_uint_least32_t page_cache_cpus_used = 0; // Highest cpu index that ever touched its cache + 1
+
+static atomic_size_t       pages;
+static page_region_t       page_regions[PAGE_REGIONS];
+static atomic_uint_least32_t page_region_count = 0; // Regions are only ever added, never removed
+static atomic_flag         region_lock = ATOMIC_FLAG_INIT;
+static atomic_flag         quickpool_coalescing[QUICKPOOL_DIVISIONS] = {0};
+
+// Pages handed back from a quickpool to free_ranges in one go
+#define QUICKPOOL_COALESCE_BUDGET 64
+
+// Quickpool refills follow the single page demand between two refills, the
+// smallest one still fills a page cache twice, the largest is 1/16 of memory
+#define QUICKPOOL_REFILL_MIN (PAGE_CACHE_BATCH * 2)
+#define QUICKPOOL_REFILL_MAX (pages / 16)
+
+// quickpools[1] up to quickpools[QUICKPOOL_POOLS] hold runs of 2, 4, 8 and 16
+// pages for short links, one entry per run linked through its first page.
+// They are refilled by splitting a larger range, and a division keeps so many
+// runs before frees of that size go back to free_ranges.
+#define QUICKPOOL_RUN_MAX_PAGES   ((size_t)1 << QUICKPOOL_POOLS)
+#define QUICKPOOL_RUN_REFILL      8
+#define QUICKPOOL_RUN_HIGH_WATER  16
+
+static atomic_flag         quickpool_run_refilling[QUICKPOOL_POOLS + 1] = {0};
+
+static atomic_size_t       quickpool_pops = 0;                            // Pages popped since the last refill
+static atomic_size_t       quickpool_demand = QUICKPOOL_REFILL_MIN;     // EWMA of quickpool_pops, written under one of the alloc_locks
+
+// Ranges that sit in free_ranges for a while get handed back to the OS. How
+// many pages may stay dirty follows a smoothstep decay over the pages freed
+// in the last PAGE_PURGE_EPOCHS epochs, an epoch being 1/16 of the decay time.
+#define PAGE_PURGE_EPOCHS        16
+#define PAGE_PURGE_TICK_INTERVAL 64 // free_ranges inserts between two looks at the clock
+#ifndef PAGE_PURGE_DECAY_MS
+#ifdef BADGEROS_KERNEL
+#define PAGE_PURGE_DECAY_MS PAGE_PURGE_NEVER
+#else
+#define PAGE_PURGE_DECAY_MS 10000
+#endif
+#endif
+#ifndef PAGE_PURGE_ADVICE
+#define PAGE_PURGE_ADVICE MADV_DONTNEED
+#endif
 
-static size_t              pages;
-static size_t              total_size;
-static uint8_t            *page_table;
-static uint8_t            *mem_end;
-static uint8_t            *pages_start;
-static uint8_t            *pages_end;
+static atomic_size_t       purge_decay_ms = PAGE_PURGE_DECAY_MS;
+static atomic_size_t       purge_epoch = 0;                            // Counts up by one for every epoch that went by
+static size_t              purge_clock = 0;                            // Epochs since boot at the last step, only touched under purge_lock
+static atomic_size_t       purge_pending = 0;                          // Pages inserted into free_ranges since the last epoch
+static atomic_size_t       purge_ticks = 0;
+static atomic_size_t       clean_pages = 0;                            // Free pages with their clean bit set
+static size_t              purge_epoch_pages[PAGE_PURGE_EPOCHS] = {0}; // Pages freed per epoch, only touched under purge_lock
+static atomic_flag         purge_lock = ATOMIC_FLAG_INIT;
+
+// Private anonymous memory reads as zero after MADV_DONTNEED, purged pages of
+// regions added as zeroed count as zeroed then. Anything else may be backed by
+// a file or device and is left as is. Define as 0 if even that doesn't hold.
+#ifndef PAGE_PURGE_ZEROES
+#if !defined(BADGEROS_KERNEL) && PAGE_PURGE_ADVICE == MADV_DONTNEED
+#define PAGE_PURGE_ZEROES 1
+#else
+#define PAGE_PURGE_ZEROES 0
+#endif
+#endif
 
-/* A comment to unconfuse clang-format */
+// Single pages zeroed ahead of time by page_alloc_prezero(), only handed out
+// by page_alloc_zeroed() unless memory runs out. They still count as free.
+#ifndef PAGE_ZERO_POOL_PAGES
+#define PAGE_ZERO_POOL_PAGES 256
+#endif
 
-static void quickpool_free(void *ptr, size_t size, size_t numb) {
-    // Determine what section of memory this block is from
-    uint32_t section = quickpool_offset(ptr);
+// Free page watermarks, all 0 until page_alloc_set_watermarks() is called.
+// Allocations leaving fewer than low free pages have the next
+// page_alloc_reclaim_poll() run the shrinkers until there are high again,
+// below min the allocation runs them itself. An allocation that finds
+// nothing always runs them before failing.
+#define PAGE_SHRINKERS 16
 
-    quickpool_push(&quickpools[0].subpool[section], ptr, numb);
-}
+typedef struct {
+    page_shrinker_t shrink;
+    void           *arg;
+} page_shrinker_entry_t;
+
+static page_shrinker_entry_t page_shrinkers[PAGE_SHRINKERS];
+static atomic_uint_least32_t page_shrinker_count = 0; // Entries are written before they are counted
+static atomic_flag         shrinker_lock = ATOMIC_FLAG_INIT;
+static atomic_size_t       watermark_min = 0;
+static atomic_size_t       watermark_low = 0;
+static atomic_size_t       watermark_high = 0;
+static atomic_bool         reclaim_pending = false;
+static atomic_flag         reclaim_lock = ATOMIC_FLAG_INIT;              // One reclaiming thread at a time
+
+static pool_t              zero_pool = {0};
+static atomic_size_t       zero_pool_target = PAGE_ZERO_POOL_PAGES;
+static atomic_flag         zero_lock = ATOMIC_FLAG_INIT;               // One prezeroing thread at a time
+
+// Pages held by page_reserve() tokens. They are taken out of free_pages up
+// front but stay where they are until page_alloc_reserved() asks for them,
+// every other allocation has to claim its pages from what is left.
+static atomic_size_t       reserved_pages = 0;
+
+// Drain and reclaim passes a reserved allocation makes before it gives up
+#define PAGE_RESERVED_ROUNDS 16
+
+#ifndef PAGE_PLACEMENT_DEFAULT
+#define PAGE_PLACEMENT_DEFAULT PAGE_PLACEMENT_HYBRID
+#endif
 
-static void* quickpool_alloc(size_t size) {
-    for (int i = 0; i < QUICKPOOL_DIVISIONS; ++i) {
-        void* item = quickpool_pop(&quickpools[0].subpool[i]);
-        if (item) {
-            //printf("%p: Got item from quickpool subdivision %i\n", pthread_self(), i);
-            return item;
+// Best fit passes on a range that would leave fewer pages than this behind,
+// as long as one of the next few larger ones doesn't
+#define PAGE_PLACEMENT_SLIVER     4
+#define PAGE_PLACEMENT_BEST_TRIES 8
+
+static atomic_uint_least32_t placement = PAGE_PLACEMENT_DEFAULT;
+
+/* A comment to unconfuse clang-format */
+
+static void quickpool_coalesce();
+static void page_mark_dirty(size_t index, size_t count);
+static void page_purge_tick();
+static void page_watermark_check();
+static size_t quickpool_run_pages();
+
+// Take count pages out of free_pages for an allocation outside a reservation,
+// or as many as there are with partial. Returns how many it got, giving up
+// after tries failed CAS attempts unless tries is 0.
+static inline size_t page_try_claim(size_t count, bool partial, uint32_t tries) {
+    size_t free = atomic_load_explicit(&free_pages, memory_order_relaxed);
+    size_t take;
+    do {
+        take = free < count ? free : count;
+        if (!take || (take < count && !partial)) {
+            return 0;
         }
-        //printf("%p: Did not get item from quickpool subdivision %i, size: %zi\n", pthread_self(), i, atomic_load(&quickpools[0].subpool[i].size));
-    }
-    return NULL;
+        if (atomic_compare_exchange_weak(&free_pages, &free, free - take)) {
+            return take;
+        }
+    } while (!tries || --tries);
+
+    return 0;
 }
 
-size_t get_free_pages() {
-    return atomic_load(&free_pages);
+static inline size_t page_claim(size_t count, bool partial) {
+    return page_try_claim(count, partial, 0);
 }
 
-size_t get_pages() {
-    return pages;
+__attribute__((always_inline)) static inline page_region_t* page_region(size_t index) {
+    return &page_regions[index >> PAGE_REGION_INDEX_BITS];
 }
 
-__attribute__((always_inline)) static inline uint8_t type_data_pack(uint8_t type, uint8_t data) {
-    type = type & 0x0F;
-    data = data & 0x0F;
+__attribute__((always_inline)) static inline size_t free_ranges_count() {
+    return (size_t)atomic_load_explicit(&page_region_count, memory_order_acquire) * FREE_RANGE_SHARDS;
+}
 
-    return (type << 4) | data;
+__attribute__((always_inline)) static inline size_t free_ranges_shard_index(size_t index) {
+    page_region_t *region = page_region(index);
+    return (index >> PAGE_REGION_INDEX_BITS) * FREE_RANGE_SHARDS + (index & PAGE_REGION_MASK) / region->shard_pages;
 }
 
-__attribute__((always_inline)) static inline uint8_t type_data_get_type(uint8_t packed) {
-    return (packed >> 4) & 0x0F;
+__attribute__((always_inline)) static inline skiplist_t* free_ranges_shard(size_t index) {
+    return &free_ranges[free_ranges_shard_index(index)];
 }
 
-__attribute__((always_inline)) static inline uint8_t type_data_get_data(uint8_t packed) {
-    return packed & 0x0F;
+// Where the node of a free range starting at index lives
+__attribute__((always_inline)) static inline range_node_t* range_node_at(size_t index) {
+#ifdef OFF_PAGE_FREE_LISTS
+    return &page_region(index)->range_nodes[index & PAGE_REGION_MASK];
+#else
+    // place the structure in the middle of the page
+    return (void*)((uintptr_t)get_page_by_index(index) + PAGE_SIZE / 2);
+#endif
 }
 
-uint8_t get_page_type(size_t index) {
-    return type_data_get_type(page_table[index]);
+#ifdef OFF_PAGE_FREE_LISTS
+__attribute__((always_inline)) static inline range_node_t* range_link_node(size_t link) {
+    if (link >= RANGE_LINK_HEAD) {
+        return &free_ranges[link - RANGE_LINK_HEAD].head;
+    }
+    return link ? range_node_at(link - 1) : NULL;
 }
 
-uint8_t get_page_data(size_t index) {
-    return type_data_get_data(page_table[index]);
+__attribute__((always_inline)) static inline size_t range_node_link(range_node_t *node) {
+    if (!node) {
+        return 0;
+    }
+
+    // The head is the first member of a shard, so this is a shard index
+    size_t shard = ((uintptr_t)node - (uintptr_t)free_ranges) / sizeof(skiplist_t);
+    if ((uintptr_t)node >= (uintptr_t)free_ranges && shard < PAGE_REGIONS * FREE_RANGE_SHARDS) {
+        return RANGE_LINK_HEAD + shard;
+    }
+    return node->start + 1;
 }
 
-__attribute__((always_inline)) static inline uint8_t get_page_type_data(size_t index) {
-    return page_table[index];
+static node_t* quickpool_node_off_page(void* page) {
+    size_t index = get_page_index(page);
+    return &page_region(index)->quickpool_nodes[index & PAGE_REGION_MASK];
+}
+#else
+__attribute__((always_inline)) static inline range_node_t* range_link_node(uintptr_t link) {
+    return (range_node_t *)link;
 }
 
-__attribute__((always_inline)) static inline void set_page_type_data(size_t index, enum allocator_type type, uint8_t data) {
-    uint8_t type_data = type_data_pack(type, data);
-    page_table[index] = type_data;
+__attribute__((always_inline)) static inline uintptr_t range_node_link(range_node_t *node) {
+    return (uintptr_t)node;
 }
+#endif
 
-size_t get_page_index(void *ptr) {
-    return ((size_t)ptr - (size_t)pages_start) / PAGE_SIZE;
+// Quickpool divisions follow the free_ranges shards of a region
+__attribute__((always_inline)) static inline uint32_t quickpool_division(void *page) {
+    return free_ranges_shard_index(get_page_index(page)) % FREE_RANGE_SHARDS;
 }
 
-void *get_page_by_index(size_t index) {
-    return pages_start + (index * PAGE_SIZE);
+// Every cpu has a home shard, and with it a home quickpool division. Carving
+// starts there and only moves on to the next shards once it has nothing, so
+// threads on different cpus mostly stay off each other's locks.
+__attribute__((always_inline)) static inline uint32_t free_ranges_home() {
+    return page_cache_cpu() % FREE_RANGE_SHARDS;
 }
 
-static void page_table_initialize() {
-    for (size_t i = 0; i < pages; i++) {
-        page_table[i] = 0;
+/* A comment to unconfuse clang-format */
+
+static void quickpool_free(void *ptr, size_t size, size_t numb) {
+    (void)size; // unused right now
+
+    // A range can straddle a division boundary, push every part to the division it is from
+    while (numb) {
+        size_t   index   = get_page_index(ptr);
+        uint32_t section = quickpool_division(ptr);
+        size_t   part    = free_ranges_shard(index)->end - index;
+
+        if (part > numb) {
+            part = numb;
+        }
+
+#ifndef OFF_PAGE_FREE_LISTS
+        // Pages straight from free_ranges might be clean, the links get written into them
+        page_mark_dirty(index, part);
+#endif
+        quickpool_push(&quickpools[0].subpool[section], ptr, part);
+        ptr   = (void*)((uintptr_t)ptr + (part * PAGE_SIZE));
+        numb -= part;
     }
 }
 
-static atomic_flag skiplist_print_lock = ATOMIC_FLAG_INIT;
+// Chain scattered pages up per division so every division only sees one push, NULLs are skipped
+static void quickpool_free_pages(void **ptrs, size_t numb) {
+    void  *first[QUICKPOOL_DIVISIONS]   = {0};
+    void  *last[QUICKPOOL_DIVISIONS]    = {0};
+    size_t chained[QUICKPOOL_DIVISIONS] = {0};
 
-void print_size_skiplist() {
-    SPIN_LOCK_LOCK(skiplist_print_lock);
-    printf("Size skiplist, free_pages: %zi\n", free_pages);
+    for (size_t i = 0; i < numb; ++i) {
+        void *page = ptrs[i];
+        if (!page) {
+            continue;
+        }
 
-    for (int i = SKIPLIST_MAX_LEVEL - 1; i >= 0; i--) {
-        range_node_t *current = &free_ranges.head;
-        printf("Level %i: ", i);
-        size_t count = 0;
-        while (current) {
-            printf("%p<(%p)>%p(%zi-%zi:%zi) -> ", (void*)current->prev_size[i], (void*)current, (void*)current->next_size[i], current->start, current->start + current->size, current->size);
-            if (current == (void*)current->next_size[i]) {
-                printf("duplicate node %p\n", current);
-                exit(1);
-            }
-            if (current == (range_node_t *)current->next_size[i]) {
-                printf("DUP!\n");
-                exit(1);
-            }
-            current = (range_node_t *)current->next_size[i];
-            if (count >= free_pages + 10) {
-                printf("LOOP!\n");
-                exit(1);
-            }
-            ++count;
+        uint32_t section = quickpool_division(page);
+
+        if (first[section]) {
+            quickpool_link(page, first[section]);
+        } else {
+            last[section] = page;
         }
-        printf("\n");
+        first[section] = page;
+        ++chained[section];
     }
-    printf("Quickpools:\n");
-    for (int i = 0; i < QUICKPOOL_DIVISIONS; ++i) {
-       printf("quickpool division %i, size: %zi, head: %p\n", i, quickpools[0].subpool[i].size, (void*)quickpools[0].subpool[i].head);
+
+    for (uint32_t i = 0; i < QUICKPOOL_DIVISIONS; ++i) {
+        if (chained[i]) {
+            quickpool_push_chain(&quickpools[0].subpool[i], first[i], last[i], chained[i]);
+        }
     }
-    SPIN_LOCK_UNLOCK(skiplist_print_lock);
 }
 
-static void print_index_skiplist() {
-    printf("Index skiplist\n");
-
-    for (int i = SKIPLIST_MAX_LEVEL - 1; i >= 0; i--) {
-        range_node_t *current = &free_ranges.head;
-        printf("Level %i: ", i);
-        while (current) {
-            printf("%p<(%p)>%p(%zi-%zi:%zi) -> ", (void*)current->prev[i], (void*)current, (void*)current->next[i], current->start, current->start + current->size, current->size);
-            if (current == (void*)current->next[i]) {
-                printf("duplicate node %p\n", current);
-                exit(1);
-            }
-            current = (range_node_t *)current->next[i];
+static void* quickpool_alloc(size_t size, uint32_t home) {
+    for (uint32_t d = 0; d < QUICKPOOL_DIVISIONS; ++d) {
+        uint32_t i = (home + d) % QUICKPOOL_DIVISIONS;
+        void* item = quickpool_pop(&quickpools[0].subpool[i]);
+        if (item) {
+            atomic_fetch_add_explicit(&quickpool_pops, 1, memory_order_relaxed);
+            //printf("%p: Got item from quickpool subdivision %i\n", pthread_self(), i);
+            return item;
         }
-        printf("\n");
+        //printf("%p: Did not get item from quickpool subdivision %i, size: %zi\n", pthread_self(), i, atomic_load(&quickpools[0].subpool[i].size));
     }
+    return NULL;
 }
 
-__attribute__((always_inline)) static inline uint32_t hash_32bit(uint32_t x) {
-    x = ((x >> 16) ^ x) * 0x45d9f3b;
-    x = ((x >> 16) ^ x) * 0x45d9f3b;
-    x = (x >> 16) ^ x;
-    return x;
-}
+static inline page_cache_t *page_cache_get() {
+    uint32_t cpu  = page_cache_cpu();
+    uint32_t used = atomic_load_explicit(&page_cache_cpus_used, memory_order_relaxed);
 
-__attribute__((always_inline)) static inline uint64_t hash_64bit(uint64_t x) {
-    x = (x ^ (x >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
-    x = (x ^ (x >> 27)) * UINT64_C(0x94d049bb133111eb);
-    x = x ^ (x >> 31);
-    return x;
+    // Only ever goes up, so a failed CAS means someone else made progress
+    while (cpu >= used) {
+        if (atomic_compare_exchange_strong(&page_cache_cpus_used, &used, cpu + 1)) {
+            break;
+        }
+    }
+
+    return &page_caches[cpu];
 }
 
-__attribute__((always_inline)) static inline uintptr_t hash_pointer(void* ptr) {
-    if (sizeof(void*) == 4)
-        return ((uintptr_t)hash_32bit((uint32_t)ptr));
+// Move up to PAGE_CACHE_BATCH pages from the quickpools into an empty cache,
+// taking them from each division with a single successful CAS
+static size_t page_cache_refill(page_cache_t *cache) {
+    size_t count = 0;
 
-    return ((uintptr_t)hash_64bit((uint64_t)ptr));
-}
+    uint32_t home = free_ranges_home();
+    for (uint32_t d = 0; d < QUICKPOOL_DIVISIONS && count < PAGE_CACHE_BATCH; ++d) {
+        size_t popped;
+        void  *page = quickpool_pop_batch(&quickpools[0].subpool[(home + d) % QUICKPOOL_DIVISIONS], PAGE_CACHE_BATCH - count, &popped);
 
-__attribute__((always_inline)) static inline uint8_t determine_node_height(void *ptr) {
-    uintptr_t hash = hash_pointer(ptr);
-    int level = 1;
+        while (page) {
+            cache->pages[count++] = page;
+            page                  = quickpool_next(page);
+        }
+    }
 
-    while ((hash & 1) == 0 && level < SKIPLIST_MAX_LEVEL) {
-        level++;
-        hash >>= 1;
+    if (count) {
+        atomic_fetch_add_explicit(&quickpool_pops, count, memory_order_relaxed);
+
+        // Whatever reservations hold on to goes right back
+        size_t claimed = page_claim(count, true);
+        if (claimed < count) {
+            quickpool_free_pages(&cache->pages[claimed], count - claimed);
+            count = claimed;
+        }
+        atomic_store_explicit(&cache->count, count, memory_order_relaxed);
     }
 
-    return level;
+    return count;
 }
 
-static inline void remove_range_size(range_node_t *node) {
-   //printf("Size remove: %p before:\n", node);
-   //print_size_skiplist();
-   for (uint32_t i = 0; i < SKIPLIST_MAX_LEVEL; ++i) {
-       range_node_t* next_size = (range_node_t*)node->next_size[i];
-       range_node_t* prev_size = (range_node_t*)node->prev_size[i];
-
-       if (next_size) {
-           //printf("Remove updating next: %p\n", next_size);
-           atomic_store_explicit(&next_size->prev_size[i], (uintptr_t)prev_size, memory_order_release);
-       }
-
-       if (prev_size) {
-           //printf("Remove updating prev: %p\n", prev_size);
-           atomic_store_explicit(&prev_size->next_size[i], node->next_size[i], memory_order_release);
-       }
-   }
-   //printf("Size remove: %p after:\n", node);
-   //print_size_skiplist();
-}
-
-static inline void remove_range(range_node_t *node) {
-   //printf("Remove: %p before:\n", node);
-   //print_size_skiplist();
-   for (uint32_t i = 0; i < SKIPLIST_MAX_LEVEL; ++i) {
-       range_node_t* next = (range_node_t*)node->next[i];
-       range_node_t* prev = (range_node_t*)node->prev[i];
-       range_node_t* next_size = (range_node_t*)node->next_size[i];
-       range_node_t* prev_size = (range_node_t*)node->prev_size[i];
-
-       if (next == node || next_size == node) {
-           printf("Fatal: loop on node %p\n");
-           exit(1);
-       }
-
-       if (next) {
-           atomic_store_explicit(&next->prev[i], (uintptr_t)prev, memory_order_release);
-       }
-       if (next_size) {
-           //printf("Updating next: %p\n", next_size);
-           atomic_store_explicit(&next_size->prev_size[i], (uintptr_t)prev_size, memory_order_release);
-       }
-
-       if (prev) {
-           atomic_store_explicit(&prev->next[i], node->next[i], memory_order_release);
-       }
-       if (prev_size) {
-           //printf("Updating prev: %p\n", prev_size);
-           atomic_store_explicit(&prev_size->next_size[i], node->next_size[i], memory_order_release);
-       }
-   }
-   //printf("Remove: %p after:\n", node);
-   //print_size_skiplist();
-}
-
-static bool skip_list_remove(range_node_t *node) {
-    // We should be locked by the caller. If not: Good luck!
+// Hand the numb coldest pages of a cache back to the quickpools, caller owns the cache
+static void page_cache_drain(page_cache_t *cache, size_t numb) {
+    size_t count = page_cache_count(cache);
+    if (numb > count) {
+        numb = count;
+    }
 
-    // Make sure we don't confuse anyone
-    uint32_t expected = RANGE_MAGIC;
-    uint32_t desired = 0;
+    if (!numb) {
+        return;
+    }
 
-    if (!atomic_compare_exchange_strong(&node->magic, &expected, desired)) {
-        return false;
+    // Account first, so a racing quickpool pop can never underflow free_pages
+    atomic_fetch_add(&free_pages, numb);
+    quickpool_free_pages(cache->pages, numb);
+
+    for (size_t i = numb; i < count; ++i) {
+        cache->pages[i - numb] = cache->pages[i];
     }
-    atomic_fetch_add(&node->dealloc_count, 1);
-    remove_range(node);
-    return true;
+    atomic_store_explicit(&cache->count, count - numb, memory_order_relaxed);
 }
 
-__attribute__((always_inline)) static inline int compare_range_size_index(range_node_t* a, range_node_t* b) {
-    if (a->size < b->size) return -1;
-    if (a->size > b->size) return 1;
+static void page_cache_drain_all() {
+    uint32_t used = atomic_load(&page_cache_cpus_used);
 
-    if (a->start < b->start) return -1;
-    if (a->start > b->start) return 1;
+    for (uint32_t i = 0; i < used; ++i) {
+        if (!page_cache_count(&page_caches[i])) {
+            continue;
+        }
 
-    printf("compare_range duplicate %p:%p\n", a, b);
-    //print_size_skiplist();
-    exit(1);
-    return 0;  // Both size and index are equal
+        SPIN_LOCK_LOCK(page_caches[i].owner);
+        page_cache_drain(&page_caches[i], PAGE_CACHE_SIZE);
+        SPIN_LOCK_UNLOCK(page_caches[i].owner);
+    }
 }
 
-static inline void insert_node_size(skiplist_t *list, range_node_t* node) {
-    range_node_t *update[SKIPLIST_MAX_LEVEL];
-    range_node_t *current = &list->head;
+static void *page_cache_alloc() {
+    page_cache_t *cache = page_cache_get();
 
-    //printf("Size insert: %p at level %i\n", node, node->level);
-
-    // Find the place to insert the new node
-    for (int i = SKIPLIST_MAX_LEVEL - 1; i >= 0; i--) {
-        while (current->next_size[i] && compare_range_size_index((range_node_t*)current->next_size[i], node) < 0) {
-            if (current == (void*)current->next_size[i]) {
-                printf("size list: duplicate node %p\n", current);
-                exit(1);
-            }
-            current = (range_node_t *)current->next_size[i];
-        }
-        update[i] = current;
+    // If we can't get our own cache we got migrated mid-operation, just use the quickpools
+    if (!SPIN_LOCK_TRY_LOCK(cache->owner)) {
+        return NULL;
     }
 
-    for (uint32_t i = 0; i < node->level + 1; i++) {
-        //printf("Updating: %p\n", update[i]);
-        range_node_t* next = (range_node_t*)update[i]->next_size[i];
-        if (next == node && next->size == 0) {
-            printf("size list: trying to create a loop on level %i %p\n", i, node);
-            exit(1);
-        }
-        if (next) {
-            atomic_store_explicit(&next->prev_size[i], (uintptr_t)node, memory_order_release);
-        }
-        atomic_store_explicit(&update[i]->next_size[i], (uintptr_t)node, memory_order_release);
-        atomic_store_explicit(&node->prev_size[i], (uintptr_t)update[i], memory_order_release);
-        atomic_store_explicit(&node->next_size[i], (uintptr_t)next, memory_order_release);
+    bool  refilled = false;
+    void *page     = page_cache_pop(cache);
+    if (!page && page_cache_refill(cache)) {
+        page     = page_cache_pop(cache);
+        refilled = true;
     }
 
-    //print_size_skiplist();
-}
+    SPIN_LOCK_UNLOCK(cache->owner);
 
-static inline void reinsert_node_size(skiplist_t *list, range_node_t* node, size_t new_size) {
-    //printf("Size re-insert: %p\n", node);
-    // Make sure we temporarily prevent this node frome being found
-    atomic_store(&node->size, 0);
-    remove_range_size(node);
-    atomic_store(&node->size, new_size);
-    insert_node_size(list, node);
+    // A refill is what moves free_pages, a reclaim has to drain this cache too
+    if (refilled) {
+        page_watermark_check();
+    }
+    return page;
 }
 
-#include <signal.h>
-
-static void insert_range_sorted(skiplist_t *list, range_node_t *node, size_t start_index, size_t size, bool coalesce) {
-    // We should be locked by the caller. If not: Good luck!
+static bool page_cache_free(void *ptr) {
+    page_cache_t *cache = page_cache_get();
 
-    // place the structure in the middle of the page
-    node = (void*)((uintptr_t)node + PAGE_SIZE / 2);
+    if (!SPIN_LOCK_TRY_LOCK(cache->owner)) {
+        return false;
+    }
 
-    if (atomic_load(&node->magic) == RANGE_MAGIC) {
-        printf("FATAL: Duplicate free? %p: alloc_count: %i, dealloc_count: %i\n", node, atomic_load(&node->alloc_count), atomic_load(&node->dealloc_count));
-        printf("-----------------------------------\n");
-        print_size_skiplist();
-        printf("-----------------------------------\n");
-        print_index_skiplist();
-        printf("-----------------------------------\n");
-        raise(SIGINT);
-        exit(1);
-        return;
+    bool drained = false;
+    if (!page_cache_push(cache, ptr)) {
+        page_cache_drain(cache, PAGE_CACHE_BATCH);
+        page_cache_push(cache, ptr);
+        drained = true;
     }
 
-    atomic_fetch_add(&node->alloc_count, 1);
-    
-    range_node_t *update[SKIPLIST_MAX_LEVEL];
-    range_node_t *current = &list->head;
+    SPIN_LOCK_UNLOCK(cache->owner);
 
-    // This is fine as the spin lock also issued an acquire fence
-    for (int i = SKIPLIST_MAX_LEVEL - 1; i >= 0; i--) {
-        while ((range_node_t *)current->next[i] != NULL && (range_node_t *)current->next[i] < node) {
-            if (current == (void*)current->next[i]) {
-                printf("index list: duplicate node %p\n", current);
-                exit(1);
-            }
-            current = (range_node_t *)current->next[i];
-        }
-        update[i] = current;
+    // The drained pages may have pushed a division over its high-water mark
+    if (drained) {
+        quickpool_coalesce();
     }
+    return true;
+}
 
-    // We now have a pointer to the place right before where we want to insert at each level
-    
-    range_node_t *next_node = (range_node_t*)update[0]->next[0];
-    while (coalesce && next_node) {
-        if (start_index + size == next_node->start) {
-            // Our new range extends into the next node
-            size += next_node->size;
-            //printf("Extending into %p\n", next_node);
-            if (!skip_list_remove(next_node)) {
-                printf("skip_list_remove failed during coalesce\n");
-                exit(1);
-            }
-            next_node = (void*)next_node->next[0];
-        } else {
-            break;
-        }
-    }
+static size_t page_cache_pages() {
+    uint32_t used  = atomic_load_explicit(&page_cache_cpus_used, memory_order_relaxed);
+    size_t   total = 0;
 
-    // at this point the update array is filled with the nodes prior to this node
-    // on level 0 we have the immediate neighboring new nodes. If the prior node on
-    // level 0 ends where we begin then don't need to insert
-    if (coalesce && update[0] != &list->head && update[0]->start + update[0]->size == start_index) {
-        //printf("Expanding %p into our space %p start_index: %zi, prior end: %zi, prior size: %zi, new size: %zi\n", update[0], node, start_index, update[0]->start + update[0]->size, update[0]->size, update[0]->size + size);
-        // This range extends the prior range
-        reinsert_node_size(list, update[0], update[0]->size + size);
-        //atomic_fetch_add(&update[0]->size, size);
-        return;
+    for (uint32_t i = 0; i < used; ++i) {
+        total += page_cache_count(&page_caches[i]);
     }
 
-    //printf("Inserting range starting at %p start_index %zi size %zi coalesce: %i before:\n", node, start_index, size, coalesce);
-    //print_index_skiplist();
+    return total;
+}
+
+size_t get_free_pages() {
+    // Pages sitting in the per-cpu caches are still free, they just aren't in free_pages.
+    // Reserved pages aren't free anymore, even though nobody has them yet.
+    return atomic_load(&free_pages) + page_cache_pages();
+}
 
-    // We are under write lock, so no other writer can be touching this node
-    // we will be ussuing a thread fence again later
-    node->start = start_index;
-    node->size = size;
-    node->magic = RANGE_MAGIC;
+size_t get_pages() {
+    return pages;
+}
 
-    // Make sure we don't have any weird pointers on other levels
-    for (uint32_t i = 0; i < SKIPLIST_MAX_LEVEL; ++i) {
-        node->next[i] = 0;
-        node->prev[i] = 0;
-        node->next_size[i] = 0;
-        node->prev_size[i] = 0;
-    }
+__attribute__((always_inline)) static inline uint8_t type_data_pack(uint8_t type, uint8_t data) {
+    type = type & 0x0F;
+    data = data & 0x0F;
 
-    int level = determine_node_height(node);
-    node->level = level - 1;
-    // Make sure that this node is fully ready
-    for (uint32_t i = 0; i < node->level + 1; i++) {
-        node->next[i] = update[i]->next[i];
-        node->prev[i] = (uintptr_t)update[i];
-    }
+    return (type << 4) | data;
+}
 
-    // All writes to the node should now be visible everywhere
-    atomic_thread_fence(memory_order_release);
+__attribute__((always_inline)) static inline uint8_t type_data_get_type(uint8_t packed) {
+    return (packed >> 4) & 0x0F;
+}
 
-    //printf("Inserting %p at level %i\n", node, node->level);
-    // Now update everyone else's pointers
-    for (uint32_t i = 0; i < node->level + 1; i++) {
-        //printf("Updating: %p\n", update[i]);
-        range_node_t* next = (range_node_t*)update[i]->next[i];
-        if (next == node) {
-            printf("index list: trying to create a loop on level %i %p\n", i, node);
-            exit(1);
-        }
-        if (next) {
-            atomic_store_explicit(&next->prev[i], (uintptr_t)node, memory_order_release);
-        }
-        atomic_store_explicit(&update[i]->next[i], (uintptr_t)node, memory_order_release);
-        //atomic_store_explicit(&node->prev[i], (uintptr_t)update[i], memory_order_release);
-        //atomic_store_explicit(&node->next[i], (uintptr_t)next, memory_order_release);
-    }
-    insert_node_size(list, node);
-    //print_index_skiplist();
-    //printf("Inserting range starting at %p start_index %zi size %zi coalesce: %i after:\n", node, start_index, size, coalesce);
-    //print_index_skiplist();
+__attribute__((always_inline)) static inline uint8_t type_data_get_data(uint8_t packed) {
+    return packed & 0x0F;
+}
+
+__attribute__((always_inline)) static inline uint8_t get_page_type_data(size_t index) {
+    return page_region(index)->page_table[index & PAGE_REGION_MASK];
 }
 
-static range_node_t* skiplist_get_largest_node(skiplist_t* list) {
-    int level = SKIPLIST_MAX_LEVEL - 1;
-    range_node_t *current = &list->head;
+__attribute__((always_inline)) static inline void set_page_type_data(size_t index, enum allocator_type type, uint8_t data) {
+    uint8_t type_data = type_data_pack(type, data);
+    page_region(index)->page_table[index & PAGE_REGION_MASK] = type_data;
+}
 
-    // Traverse down and right, as far as possible
-    while (level >= 0) {
-        while (true) {
-            range_node_t *next_node = (range_node_t *)atomic_load(&current->next_size[level]);
-            if (next_node) {
-                current = next_node;
-            } else {
-                break; // We're at the rightmost node of this level
-            }
-        }
-        level--;
-    }
+__attribute__((always_inline)) static inline uint32_t* page_link_size(size_t index) {
+    return &page_region(index)->link_sizes[index & PAGE_REGION_MASK];
+}
 
-    // Once we're at level 0 and at the rightmost node, check its size
-    size_t current_size = atomic_load(&current->size);
-    if (current_size == 0) {
-        // Get the previous node since this one has size 0
-        current = (range_node_t *)atomic_load(&current->prev_size[0]);
-    }
-    
-    if (current != &list->head) {
-        return current;
-    } else {
-        return NULL;
-    }
+uint8_t get_page_type(size_t index) {
+    return type_data_get_type(get_page_type_data(index));
 }
 
-static void* skiplist_get_firstfit(skiplist_t* list, size_t size) {
-    range_node_t *update[SKIPLIST_MAX_LEVEL];
-    range_node_t *current = &list->head;
-    range_node_t *node = NULL;
+uint8_t get_page_data(size_t index) {
+    return type_data_get_data(get_page_type_data(index));
+}
 
-    for (int i = SKIPLIST_MAX_LEVEL - 1; i >= 0; i--) {
-        while ((node = (void*)atomic_load_explicit(&current->next_size[i], memory_order_relaxed))) {
-            size_t node_size = atomic_load_explicit(&node->size, memory_order_relaxed);
-            if (node_size && node_size >= size) {
-                break;
-            }
-            current = node;
+// There are only a handful of regions, and almost always just the first one
+size_t get_page_index(void *ptr) {
+    uint32_t count = atomic_load_explicit(&page_region_count, memory_order_acquire);
+    for (uint32_t i = 0; i < count; ++i) {
+        page_region_t *region = &page_regions[i];
+        if ((uint8_t*)ptr >= region->pages_start && (uint8_t*)ptr < region->pages_end) {
+            return ((size_t)i << PAGE_REGION_INDEX_BITS) + ((size_t)ptr - (size_t)region->pages_start) / PAGE_SIZE;
         }
     }
+    return SIZE_MAX;
+}
 
-    if (node != &list->head) {
-        return node;
-    } else {
-        return NULL;
-    }
+void *get_page_by_index(size_t index) {
+    return page_region(index)->pages_start + ((index & PAGE_REGION_MASK) * PAGE_SIZE);
 }
 
-static size_t skiplist_get_largest_size(skiplist_t* list) {
-    range_node_t *node = skiplist_get_largest_node(list);
+bool is_page_index_valid(size_t index) {
+    return (index >> PAGE_REGION_INDEX_BITS) < atomic_load_explicit(&page_region_count, memory_order_acquire) &&
+           (index & PAGE_REGION_MASK) < page_region(index)->pages;
+}
 
-    //print_size_skiplist();
-    //print_index_skiplist();
-    if (node)
-        return node->size;
-    return 0;
+__attribute__((always_inline)) static inline size_t page_bitmap_words(size_t pages) {
+    return (pages + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS;
 }
 
-size_t get_largest_size() {
-    return skiplist_get_largest_size(&free_ranges);
+__attribute__((always_inline)) static inline size_t page_bitmap_size(size_t pages) {
+    size_t words = page_bitmap_words(pages);
+    return (words + page_bitmap_words(words)) * BITMAP_WORD_BYTES;
 }
 
-static void* skiplist_get_pages(skiplist_t* list, size_t *size, size_t slack, bool at_end) {
-    SPIN_LOCK_LOCK(list->write_lock);
-start:
+// The region isn't published yet, nobody else can look at the words while we clear them
+static void page_bitmap_initialize(page_bitmap_t *bitmap, bitmap_word_atomic *memory, size_t pages, bool zeroed) {
+    size_t words = page_bitmap_words(pages);
+
+    bitmap->words   = memory;
+    bitmap->summary = memory + words;
+    if (!zeroed) {
+        __builtin_memset(memory, 0, page_bitmap_size(pages));
+    }
+}
+
+__attribute__((always_inline)) static inline bitmap_word page_bitmap_bit(size_t bit) {
+    return (bitmap_word)1 << (bit % BITMAP_WORD_BITS);
+}
+
+// A word just got its last bit cleared, the summary bit may only go if
+// nobody set another bit in it in the meantime
+static void page_bitmap_summary_clear(page_bitmap_t *bitmap, size_t word) {
+    atomic_fetch_and(&bitmap->summary[word / BITMAP_WORD_BITS], ~page_bitmap_bit(word));
+    if (atomic_load(&bitmap->words[word])) {
+        atomic_fetch_or(&bitmap->summary[word / BITMAP_WORD_BITS], page_bitmap_bit(word));
+    }
+}
+
+// Set or clear count bits starting at local. Returns false if any of them
+// already was in that state.
+static bool page_bitmap_update(page_bitmap_t *bitmap, size_t local, size_t count, bool set) {
+    bool valid = true;
+
+    while (count) {
+        size_t word = local / BITMAP_WORD_BITS;
+        size_t bit  = local % BITMAP_WORD_BITS;
+        size_t part = BITMAP_WORD_BITS - bit;
+        if (part > count) {
+            part = count;
+        }
+
+        bitmap_word mask = (part == BITMAP_WORD_BITS ? BITMAP_WORD_MAX : (page_bitmap_bit(part) - 1)) << bit;
+        if (set) {
+            bitmap_word old = atomic_fetch_or(&bitmap->words[word], mask);
+            if (!old) {
+                atomic_fetch_or(&bitmap->summary[word / BITMAP_WORD_BITS], page_bitmap_bit(word));
+            }
+            valid &= !(old & mask);
+        } else {
+            bitmap_word old = atomic_fetch_and(&bitmap->words[word], ~mask);
+            if (old && !(old & ~mask)) {
+                page_bitmap_summary_clear(bitmap, word);
+            }
+            valid &= (old & mask) == mask;
+        }
+
+        local += part;
+        count -= part;
+    }
+
+    return valid;
+}
+
+__attribute__((always_inline)) static inline bool page_bitmap_get(page_bitmap_t *bitmap, size_t local) {
+    return atomic_load(&bitmap->words[local / BITMAP_WORD_BITS]) & page_bitmap_bit(local);
+}
+
+// Count the clear bits from local on, stopping at limit. Clear words and
+// clear summary words get skipped without looking at every bit.
+static size_t page_bitmap_clear_run(page_bitmap_t *bitmap, size_t local, size_t limit) {
+    size_t start = local;
+
+    while (local < limit) {
+        size_t word = local / BITMAP_WORD_BITS;
+        size_t bit  = local % BITMAP_WORD_BITS;
+
+        if (!bit && !(word % BITMAP_WORD_BITS) && !atomic_load(&bitmap->summary[word / BITMAP_WORD_BITS])) {
+            local += BITMAP_WORD_BITS * BITMAP_WORD_BITS;
+            continue;
+        }
+
+        size_t clear = bitmap_count_trailing_unset_bits(atomic_load(&bitmap->words[word]) >> bit);
+        if (clear > BITMAP_WORD_BITS - bit) {
+            clear = BITMAP_WORD_BITS - bit;
+        }
+
+        local += clear;
+        if (clear < BITMAP_WORD_BITS - bit) {
+            break;
+        }
+    }
+
+    return (local < limit ? local : limit) - start;
+}
+
+// Count the set bits from local on, stopping at limit
+static size_t page_bitmap_set_run(page_bitmap_t *bitmap, size_t local, size_t limit) {
+    size_t start = local;
+
+    while (local < limit) {
+        size_t bit = local % BITMAP_WORD_BITS;
+        size_t set = bitmap_count_trailing_set_bits(atomic_load(&bitmap->words[local / BITMAP_WORD_BITS]) >> bit);
+        if (set > BITMAP_WORD_BITS - bit) {
+            set = BITMAP_WORD_BITS - bit;
+        }
+
+        local += set;
+        if (set < BITMAP_WORD_BITS - bit) {
+            break;
+        }
+    }
+
+    return (local < limit ? local : limit) - start;
+}
+
+// Clear count bits starting at local, returns how many of them were set.
+// Words without any of those bits set are only read.
+static size_t page_bitmap_take(page_bitmap_t *bitmap, size_t local, size_t count) {
+    size_t taken = 0;
+
+    while (count) {
+        size_t word = local / BITMAP_WORD_BITS;
+        size_t bit  = local % BITMAP_WORD_BITS;
+        size_t part = BITMAP_WORD_BITS - bit;
+        if (part > count) {
+            part = count;
+        }
+
+        bitmap_word mask = (part == BITMAP_WORD_BITS ? BITMAP_WORD_MAX : (page_bitmap_bit(part) - 1)) << bit;
+        if (atomic_load_explicit(&bitmap->words[word], memory_order_relaxed) & mask) {
+            bitmap_word old = atomic_fetch_and(&bitmap->words[word], ~mask);
+            if (old && !(old & ~mask)) {
+                page_bitmap_summary_clear(bitmap, word);
+            }
+            taken += bitmap_count_set_bits(old & mask);
+        }
+
+        local += part;
+        count -= part;
+    }
+
+    return taken;
+}
+
+// Find the first set bit at or after local, limit if there is none
+static size_t page_bitmap_next_set(page_bitmap_t *bitmap, size_t local, size_t limit) {
+    return local + page_bitmap_clear_run(bitmap, local, limit);
+}
+
+static size_t page_bitmap_count(page_bitmap_t *bitmap, size_t pages) {
+    size_t words = page_bitmap_words(pages);
+    size_t count = 0;
+
+    for (size_t i = 0; i < page_bitmap_words(words); ++i) {
+        bitmap_word summary = atomic_load(&bitmap->summary[i]);
+        while (summary) {
+            size_t bit = bitmap_count_trailing_unset_bits(summary);
+            summary &= summary - 1;
+            count += bitmap_count_set_bits(atomic_load(&bitmap->words[i * BITMAP_WORD_BITS + bit]));
+        }
+    }
+
+    return count;
+}
+
+// Pages that are about to be written to aren't clean or zero anymore. Once
+// memory got used a bit their written bits are set already, that only takes a read.
+static void page_mark_dirty(size_t index, size_t count) {
+    page_region_t *region = page_region(index);
+    size_t         local  = index & PAGE_REGION_MASK;
+
+    if (page_bitmap_set_run(&region->written, local, local + count) != count) {
+        page_bitmap_update(&region->written, local, count, true);
+    }
+
+    if (!atomic_load_explicit(&clean_pages, memory_order_relaxed)) {
+        return;
+    }
+
+    size_t taken = page_bitmap_take(&region->clean, local, count);
+    if (taken) {
+        atomic_fetch_sub(&clean_pages, taken);
+    }
+}
+
+// Clear the pages of count starting at index that may not be zero, synchronously
+// and through the cache as the caller is about to use them
+static void page_zero_run(size_t index, size_t count) {
+    page_region_t *region = page_region(index);
+    size_t         local  = index & PAGE_REGION_MASK;
+    size_t         end    = local + count;
+
+    while (local < end) {
+        local += page_bitmap_clear_run(&region->written, local, end);
+
+        size_t written = page_bitmap_set_run(&region->written, local, end);
+        __builtin_memset(region->pages_start + local * PAGE_SIZE, 0, written * PAGE_SIZE);
+        local += written;
+    }
+}
+
+// Hand count pages starting at index out as type
+static void page_mark_used(size_t index, size_t count, enum allocator_type type) {
+    page_region_t *region = page_region(index);
+
+    page_mark_dirty(index, count);
+    page_bitmap_update(&region->used, index & PAGE_REGION_MASK, count, true);
+    page_bitmap_update(&region->types[type], index & PAGE_REGION_MASK, count, true);
+}
+
+// Take count pages starting at index back. Returns false, without changing
+// anything, if the first of them was not handed out.
+static bool page_mark_free(size_t index, size_t count) {
+    page_region_t *region = page_region(index);
+    size_t         local  = index & PAGE_REGION_MASK;
+
+    if (!page_bitmap_update(&region->used, local, 1, false)) {
+        return false;
+    }
+    page_bitmap_update(&region->used, local + 1, count - 1, false);
+    page_bitmap_update(&region->types[type_data_get_type(get_page_type_data(index))], local, count, false);
+    return true;
+}
+
+// Count the free pages from index on, stopping at max
+static size_t page_free_run(size_t index, size_t max) {
+    page_region_t *region = page_region(index);
+    size_t         local  = index & PAGE_REGION_MASK;
+    size_t         limit  = region->pages - local < max ? region->pages : local + max;
+
+    return page_bitmap_clear_run(&region->used, local, limit);
+}
+
+uint8_t is_page_free(void *ptr) {
+    size_t index = get_page_index(ptr);
+    if (index == SIZE_MAX) {
+        return false;
+    }
+
+    return !page_bitmap_get(&page_region(index)->used, index & PAGE_REGION_MASK);
+}
+
+size_t get_used_pages() {
+    uint32_t count = atomic_load_explicit(&page_region_count, memory_order_acquire);
+    size_t   used  = 0;
+
+    for (uint32_t r = 0; r < count; ++r) {
+        used += page_bitmap_count(&page_regions[r].used, page_regions[r].pages);
+    }
+
+    return used;
+}
+
+size_t get_page_index_by_type_data(size_t start_index, enum allocator_type type, uint8_t data) {
+    uint32_t count = atomic_load_explicit(&page_region_count, memory_order_acquire);
+
+    for (uint32_t r = start_index >> PAGE_REGION_INDEX_BITS; r < count; ++r) {
+        page_region_t *region = &page_regions[r];
+        size_t         base   = (size_t)r << PAGE_REGION_INDEX_BITS;
+        size_t         local  = r == start_index >> PAGE_REGION_INDEX_BITS ? start_index & PAGE_REGION_MASK : 0;
+
+        while ((local = page_bitmap_next_set(&region->types[type], local, region->pages)) < region->pages) {
+            uint8_t type_data = get_page_type_data(base + local);
+            if (type_data_get_data(type_data) == data) {
+                return base + local;
+            }
+
+            // Don't walk through the tail of a link one page at a time
+            if (type == ALLOCATOR_PAGE_LINK && type_data_get_data(type_data) == PAGE_LINK_HEAD && *page_link_size(base + local)) {
+                local += *page_link_size(base + local);
+            } else {
+                ++local;
+            }
+        }
+    }
+
+    return SIZE_MAX;
+}
+
+static atomic_flag skiplist_print_lock = ATOMIC_FLAG_INIT;
+
+void print_size_skiplist() {
+    SPIN_LOCK_LOCK(skiplist_print_lock);
+    printf("Size skiplist, free_pages: %zi\n", free_pages);
+
+    for (size_t shard = 0; shard < free_ranges_count(); ++shard) {
+        printf("Shard %zi (%zi-%zi):\n", shard, free_ranges[shard].first, free_ranges[shard].end);
+        for (int i = SKIPLIST_MAX_LEVEL - 1; i >= 0; i--) {
+            range_node_t *current = &free_ranges[shard].head;
+            printf("Level %i: ", i);
+            size_t count = 0;
+            while (current) {
+                printf("%p<(%p)>%p(%zi-%zi:%zi) -> ", range_link_node(current->prev_size[i]), (void*)current, range_link_node(current->next_size[i]), current->start, current->start + current->size, current->size);
+                if (current == range_link_node(current->next_size[i])) {
+                    printf("duplicate node %p\n", current);
+                    exit(1);
+                }
+                current = range_link_node(current->next_size[i]);
+                if (count >= free_pages + 10) {
+                    printf("LOOP!\n");
+                    exit(1);
+                }
+                ++count;
+            }
+            printf("\n");
+        }
+    }
+    printf("Quickpools:\n");
+    for (int i = 0; i < QUICKPOOL_DIVISIONS; ++i) {
+       printf("quickpool division %i, size: %zi, head: %zi\n", i, quickpools[0].subpool[i].size, quickpool_head_index(quickpools[0].subpool[i].head));
+    }
+    printf("Page caches: %zi pages\n", page_cache_pages());
+    SPIN_LOCK_UNLOCK(skiplist_print_lock);
+}
+
+static void print_index_skiplist() {
+    printf("Index skiplist\n");
+
+    for (size_t shard = 0; shard < free_ranges_count(); ++shard) {
+        printf("Shard %zi (%zi-%zi):\n", shard, free_ranges[shard].first, free_ranges[shard].end);
+        for (int i = SKIPLIST_MAX_LEVEL - 1; i >= 0; i--) {
+            range_node_t *current = &free_ranges[shard].head;
+            printf("Level %i: ", i);
+            while (current) {
+                printf("%p<(%p)>%p(%zi-%zi:%zi) -> ", range_link_node(current->prev[i]), (void*)current, range_link_node(current->next[i]), current->start, current->start + current->size, current->size);
+                if (current == range_link_node(current->next[i])) {
+                    printf("duplicate node %p\n", current);
+                    exit(1);
+                }
+                current = range_link_node(current->next[i]);
+            }
+            printf("\n");
+        }
+    }
+}
+
+__attribute__((always_inline)) static inline uint32_t hash_32bit(uint32_t x) {
+    x = ((x >> 16) ^ x) * 0x45d9f3b;
+    x = ((x >> 16) ^ x) * 0x45d9f3b;
+    x = (x >> 16) ^ x;
+    return x;
+}
+
+__attribute__((always_inline)) static inline uint64_t hash_64bit(uint64_t x) {
+    x = (x ^ (x >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+    x = (x ^ (x >> 27)) * UINT64_C(0x94d049bb133111eb);
+    x = x ^ (x >> 31);
+    return x;
+}
+
+__attribute__((always_inline)) static inline uintptr_t hash_pointer(void* ptr) {
+    if (sizeof(void*) == 4)
+        return ((uintptr_t)hash_32bit((uint32_t)ptr));
+
+    return ((uintptr_t)hash_64bit((uint64_t)ptr));
+}
+
+__attribute__((always_inline)) static inline uint8_t determine_node_height(void *ptr) {
+    uintptr_t hash = hash_pointer(ptr);
+    int level = 1;
+
+    while ((hash & 1) == 0 && level < SKIPLIST_MAX_LEVEL) {
+        level++;
+        hash >>= 1;
+    }
+
+    return level;
+}
+
+__attribute__((always_inline)) static inline uint32_t free_range_bin_log2(size_t size) {
+    return BITMAP_WORD_BITS - 1 - bitmap_count_leading_unset_bits((bitmap_word)size);
+}
+
+// Bin a range of size pages gets filed in, as level * FREE_RANGE_BIN_SUBS + sub
+__attribute__((always_inline)) static inline uint32_t free_range_bin(size_t size) {
+    if (size < FREE_RANGE_BIN_SUBS) {
+        return size;
+    }
+
+    uint32_t log = free_range_bin_log2(size);
+    return (log - FREE_RANGE_BIN_SUB_BITS + 1) * FREE_RANGE_BIN_SUBS + (size >> (log - FREE_RANGE_BIN_SUB_BITS)) - FREE_RANGE_BIN_SUBS;
+}
+
+// First bin where every range fits size pages
+__attribute__((always_inline)) static inline uint32_t free_range_bin_search(size_t size) {
+    if (size >= FREE_RANGE_BIN_SUBS) {
+        size += ((size_t)1 << (free_range_bin_log2(size) - FREE_RANGE_BIN_SUB_BITS)) - 1;
+    }
+    return free_range_bin(size);
+}
+
+// Writers lock single nodes rather than a whole shard. Whoever changes the
+// links, size or bin of a node holds its lock, the shard heads have one too.
+// Locks are only ever tried: a writer that finds one taken lets go of all it
+// holds and starts over, so nobody waits for a node while holding another.
+// Lists are walked hand over hand, the next node gets locked while the one
+// linking to it is held, and taking a node out locks the ones in front of
+// it. The nodes inside free pages can't be handed out under a walker's feet
+// that way. Writes only start once everything they touch is locked, so a busy
+// node never leaves anything half done. Ranges in different parts of a shard
+// go in and out in parallel, they only meet at the head and taller nodes.
+//
+// A group holds at most a range going away with its neighbours on both
+// lists, one being resized or placed with its new ones, and the ranges of
+// a spanning run.
+#define RANGE_LOCK_GROUP_MAX (SKIPLIST_MAX_LEVEL * 13)
+#define RANGE_GONE_MAX       2
+
+enum range_lock_status {
+    RANGE_BUSY,   // Someone else holds it
+    RANGE_LOCKED, // Locked just now
+    RANGE_HELD,   // The group had it already
+};
+
+typedef struct {
+    range_node_t *nodes[RANGE_LOCK_GROUP_MAX];
+    uint32_t      count;
+    uint32_t      kept;                       // The first kept nodes stay locked on release
+    range_node_t *gone[RANGE_GONE_MAX];       // Nodes on their way out of a list, walks step over them
+    bool          gone_index[RANGE_GONE_MAX]; // Out of the index list as well, not just the size list
+    uint32_t      gone_count;
+} range_lock_group_t;
+
+__attribute__((always_inline)) static inline void range_group_init(range_lock_group_t *group) {
+    group->count      = 0;
+    group->kept       = 0;
+    group->gone_count = 0;
+}
+
+static enum range_lock_status range_group_lock(range_lock_group_t *group, range_node_t *node) {
+    // Only a node that is locked already can be one of ours
+    if (!SPIN_LOCK_TRY_LOCK(node->lock)) {
+        for (uint32_t i = 0; i < group->count; ++i) {
+            if (group->nodes[i] == node) {
+                return RANGE_HELD;
+            }
+        }
+        return RANGE_BUSY;
+    }
+
+    if (group->count >= RANGE_LOCK_GROUP_MAX) {
+        printf("range_group_lock: lock group full\n");
+        exit(1);
+    }
+    group->nodes[group->count++] = node;
+    return RANGE_LOCKED;
+}
+
+// Let go of a node that was only locked to walk past it
+static void range_group_drop(range_lock_group_t *group, range_node_t *node) {
+    for (uint32_t i = group->count; i > group->kept; --i) {
+        if (group->nodes[i - 1] == node) {
+            group->nodes[i - 1] = group->nodes[--group->count];
+            SPIN_LOCK_UNLOCK(node->lock);
+            return;
+        }
+    }
+}
+
+// Let go of everything but the kept nodes
+static void range_group_release(range_lock_group_t *group) {
+    while (group->count > group->kept) {
+        range_node_t *node = group->nodes[--group->count];
+        SPIN_LOCK_UNLOCK(node->lock);
+    }
+    group->gone_count = 0;
+}
+
+// Wait a little longer every time a node turned out busy
+__attribute__((always_inline)) static inline void range_group_backoff(uint32_t tries) {
+    DELAY((size_t)1 << (tries < 10 ? tries : 10));
+}
+
+static void range_group_add_gone(range_lock_group_t *group, range_node_t *node, bool index) {
+    if (group->gone_count >= RANGE_GONE_MAX) {
+        printf("range_group_add_gone: too many nodes on their way out\n");
+        exit(1);
+    }
+    group->gone[group->gone_count]       = node;
+    group->gone_index[group->gone_count] = index;
+    ++group->gone_count;
+}
+
+__attribute__((always_inline)) static inline bool range_group_gone(range_lock_group_t *group, range_node_t *node, bool by_size) {
+    for (uint32_t i = 0; i < group->gone_count; ++i) {
+        if (group->gone[i] == node && (by_size || group->gone_index[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+__attribute__((always_inline)) static inline range_link_t* range_next_link(range_node_t *node, bool by_size, uint32_t level) {
+    return by_size ? &node->next_size[level] : &node->next[level];
+}
+
+__attribute__((always_inline)) static inline range_link_t* range_prev_link(range_node_t *node, bool by_size, uint32_t level) {
+    return by_size ? &node->prev_size[level] : &node->prev[level];
+}
+
+// Level of the node of a range starting at index
+__attribute__((always_inline)) static inline uint32_t range_level(size_t index) {
+    return determine_node_height(range_node_at(index)) - 1;
+}
+
+// Next node on a list, stepping over the ones the group takes out of it.
+// Those are held by the group, so following their links is fine.
+static range_node_t* range_next(range_lock_group_t *group, range_node_t *node, bool by_size, uint32_t level) {
+    range_node_t *next = range_link_node(atomic_load_explicit(range_next_link(node, by_size, level), memory_order_relaxed));
+    while (next && range_group_gone(group, next, by_size)) {
+        next = range_link_node(atomic_load_explicit(range_next_link(next, by_size, level), memory_order_relaxed));
+    }
+    return next;
+}
+
+// Whether node sorts in front of a range of size pages starting at start.
+// The size list goes by size first, both lists go by start after that. The
+// node in front of this one on the list is held, so neither changes.
+__attribute__((always_inline)) static inline bool range_before(range_node_t *node, bool by_size, size_t size, size_t start) {
+    size_t node_size = atomic_load_explicit(&node->size, memory_order_relaxed);
+    if (by_size && node_size != size) {
+        return node_size < size;
+    }
+    return atomic_load_explicit(&node->start, memory_order_relaxed) < start;
+}
+
+// Walk a list from the head to the last node in front of (size, start) on
+// every level. The ones found on levels up to keep stay locked, every other
+// node only while walking past it. Returns false if a node is busy.
+static bool range_walk(range_lock_group_t *group, skiplist_t *list, bool by_size, size_t size, size_t start, uint32_t keep, range_node_t **prev) {
+    range_node_t          *current = &list->head;
+    enum range_lock_status status  = range_group_lock(group, current);
+    if (status == RANGE_BUSY) {
+        return false;
+    }
+    bool passing = status == RANGE_LOCKED;
+
+    for (int i = SKIPLIST_MAX_LEVEL - 1; i >= 0; i--) {
+        range_node_t *next;
+        while ((next = range_next(group, current, by_size, i)) && range_before(next, by_size, size, start)) {
+            status = range_group_lock(group, next);
+            if (status == RANGE_BUSY) {
+                return false;
+            }
+            if (passing) {
+                range_group_drop(group, current);
+            }
+            current = next;
+            passing = status == RANGE_LOCKED;
+        }
+
+        prev[i] = current;
+        if ((uint32_t)i <= keep) {
+            passing = false;
+        }
+    }
+
+    return true;
+}
+
+// Move a walk along level 0 of a list to the next node, hand over hand.
+// Returns false if that one is busy, *node ends up NULL past the tail.
+static bool range_step(range_lock_group_t *group, range_node_t **node, bool by_size) {
+    range_node_t *next = range_next(group, *node, by_size, 0);
+    if (next && range_group_lock(group, next) == RANGE_BUSY) {
+        return false;
+    }
+
+    range_group_drop(group, *node);
+    *node = next;
+    return true;
+}
+
+// Lock the nodes behind a new place in a list, up to level
+static bool range_lock_next(range_lock_group_t *group, range_node_t **prev, uint32_t level, bool by_size) {
+    for (uint32_t i = 0; i <= level; ++i) {
+        range_node_t *next = range_next(group, prev[i], by_size, i);
+        if (next && range_group_lock(group, next) == RANGE_BUSY) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Lock the neighbours of a held node in one list. They can't go away while
+// the node is held, taking them out would need it locked as well.
+static bool range_lock_neighbors(range_lock_group_t *group, range_node_t *node, bool by_size) {
+    uint32_t level = atomic_load_explicit(&node->level, memory_order_relaxed);
+    for (uint32_t i = 0; i <= level; ++i) {
+        range_node_t *prev = range_link_node(atomic_load_explicit(range_prev_link(node, by_size, i), memory_order_relaxed));
+        range_node_t *next = range_link_node(atomic_load_explicit(range_next_link(node, by_size, i), memory_order_relaxed));
+
+        if (range_group_lock(group, prev) == RANGE_BUSY || (next && range_group_lock(group, next) == RANGE_BUSY)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void skiplist_bin_insert(skiplist_t *list, range_node_t *node) {
+    uint32_t       bin   = free_range_bin(node->size);
+    uint32_t       level = bin / FREE_RANGE_BIN_SUBS;
+    uint32_t       sub   = bin % FREE_RANGE_BIN_SUBS;
+
+    SPIN_LOCK_LOCK(list->bin_locks[level][sub]);
+    range_node_t  *first = list->bins[level][sub];
+
+    atomic_store_explicit(&node->bin, bin, memory_order_relaxed);
+    atomic_store_explicit(&node->prev_bin, 0, memory_order_relaxed);
+    atomic_store_explicit(&node->next_bin, range_node_link(first), memory_order_relaxed);
+    if (first) {
+        atomic_store_explicit(&first->prev_bin, range_node_link(node), memory_order_relaxed);
+    }
+
+    list->bins[level][sub] = node;
+    atomic_fetch_or_explicit(&list->bin_subs[level], (bitmap_word)1 << sub, memory_order_relaxed);
+    atomic_fetch_or_explicit(&list->bin_levels, (bitmap_word)1 << level, memory_order_relaxed);
+    SPIN_LOCK_UNLOCK(list->bin_locks[level][sub]);
+}
+
+static void skiplist_bin_remove(skiplist_t *list, range_node_t *node) {
+    uint32_t      bin   = atomic_load_explicit(&node->bin, memory_order_relaxed);
+    uint32_t      level = bin / FREE_RANGE_BIN_SUBS;
+    uint32_t      sub   = bin % FREE_RANGE_BIN_SUBS;
+
+    SPIN_LOCK_LOCK(list->bin_locks[level][sub]);
+    range_node_t *next  = range_link_node(atomic_load_explicit(&node->next_bin, memory_order_relaxed));
+    range_node_t *prev  = range_link_node(atomic_load_explicit(&node->prev_bin, memory_order_relaxed));
+
+    if (next) {
+        atomic_store_explicit(&next->prev_bin, range_node_link(prev), memory_order_relaxed);
+    }
+    if (prev) {
+        atomic_store_explicit(&prev->next_bin, range_node_link(next), memory_order_relaxed);
+    } else {
+        list->bins[level][sub] = next;
+    }
+
+    if (!list->bins[level][sub]) {
+        bitmap_word bit = (bitmap_word)1 << sub;
+        if (!(atomic_fetch_and_explicit(&list->bin_subs[level], ~bit, memory_order_relaxed) & ~bit)) {
+            // Another bin of this level may have been filled in the meantime
+            atomic_fetch_and_explicit(&list->bin_levels, ~((bitmap_word)1 << level), memory_order_relaxed);
+            if (atomic_load_explicit(&list->bin_subs[level], memory_order_relaxed)) {
+                atomic_fetch_or_explicit(&list->bin_levels, (bitmap_word)1 << level, memory_order_relaxed);
+            }
+        }
+    }
+    SPIN_LOCK_UNLOCK(list->bin_locks[level][sub]);
+}
+
+// A range of at least size pages in O(1), not necessarily the smallest one.
+// Only bins every range of which fits get looked at. The range comes back
+// locked, it can't leave its bin while the bin lock is held. Returns false
+// if it is busy, *out is NULL if the bits were stale.
+static bool skiplist_get_binfit(range_lock_group_t *group, skiplist_t *list, size_t size, range_node_t **out) {
+    uint32_t bin   = free_range_bin_search(size);
+    uint32_t level = bin / FREE_RANGE_BIN_SUBS;
+    uint32_t sub   = bin % FREE_RANGE_BIN_SUBS;
+
+    *out = NULL;
+    if (level >= FREE_RANGE_BIN_LEVELS) {
+        return true;
+    }
+
+    bitmap_word subs = atomic_load_explicit(&list->bin_subs[level], memory_order_relaxed) & (BITMAP_WORD_MAX << sub);
+    if (!subs) {
+        bitmap_word levels = level + 1 < BITMAP_WORD_BITS ? atomic_load_explicit(&list->bin_levels, memory_order_relaxed) & (BITMAP_WORD_MAX << (level + 1)) : 0;
+        if (!levels) {
+            return true;
+        }
+
+        level = bitmap_count_trailing_unset_bits(levels);
+        subs  = atomic_load_explicit(&list->bin_subs[level], memory_order_relaxed);
+        if (!subs) {
+            return true;
+        }
+    }
+    sub = bitmap_count_trailing_unset_bits(subs);
+
+    SPIN_LOCK_LOCK(list->bin_locks[level][sub]);
+    range_node_t *node = list->bins[level][sub];
+    bool          busy = node && range_group_lock(group, node) == RANGE_BUSY;
+    SPIN_LOCK_UNLOCK(list->bin_locks[level][sub]);
+
+    if (busy) {
+        return false;
+    }
+    *out = node;
+    return true;
+}
+
+// Ranges touching either end of the shard are what runs across shards are
+// made of, set size to 0 before node goes away or shrinks
+static inline void skiplist_set_runs(skiplist_t *list, range_node_t *node, size_t size) {
+    if (node->start == list->first) {
+        atomic_store_explicit(&list->head_run, size, memory_order_relaxed);
+    }
+    if (node->start + node->size == list->end) {
+        atomic_store_explicit(&list->tail_run, size, memory_order_relaxed);
+    }
+}
+
+// Take a node out of one list, everything around it is held
+static void range_unlink(skiplist_t *list, range_node_t *node, bool by_size) {
+    uint32_t level = atomic_load_explicit(&node->level, memory_order_relaxed);
+
+    // The tail of the size list hands over to the next smaller range. Its
+    // lock is held by whoever changes the tail, so largest_size stays in order.
+    if (by_size && !atomic_load_explicit(&node->next_size[0], memory_order_relaxed)) {
+        range_node_t *prev = range_link_node(atomic_load_explicit(&node->prev_size[0], memory_order_relaxed));
+        atomic_store_explicit(&list->largest_size, prev != &list->head ? atomic_load_explicit(&prev->size, memory_order_relaxed) : 0, memory_order_relaxed);
+    }
+
+    for (uint32_t i = 0; i <= level; ++i) {
+        range_node_t *next = range_link_node(atomic_load_explicit(range_next_link(node, by_size, i), memory_order_relaxed));
+        range_node_t *prev = range_link_node(atomic_load_explicit(range_prev_link(node, by_size, i), memory_order_relaxed));
+
+        if (next == node) {
+            printf("Fatal: loop on node %p\n", node);
+            exit(1);
+        }
+        if (next) {
+            atomic_store_explicit(range_prev_link(next, by_size, i), range_node_link(prev), memory_order_relaxed);
+        }
+        atomic_store_explicit(range_next_link(prev, by_size, i), range_node_link(next), memory_order_relaxed);
+    }
+}
+
+// Put a node into one list behind the nodes a walk found. Anything this
+// group placed there since sits in front of it, or behind it, and is held.
+static void range_link(skiplist_t *list, range_node_t *node, range_node_t **prev, bool by_size) {
+    uint32_t level = atomic_load_explicit(&node->level, memory_order_relaxed);
+    size_t   size  = atomic_load_explicit(&node->size, memory_order_relaxed);
+    size_t   start = atomic_load_explicit(&node->start, memory_order_relaxed);
+
+    for (uint32_t i = 0; i <= level; ++i) {
+        range_node_t *before = prev[i];
+        range_node_t *next;
+        while ((next = range_link_node(atomic_load_explicit(range_next_link(before, by_size, i), memory_order_relaxed))) && range_before(next, by_size, size, start)) {
+            before = next;
+        }
+
+        if (next == node) {
+            printf("Fatal: trying to create a loop on level %i %p\n", i, node);
+            exit(1);
+        }
+        atomic_store_explicit(range_next_link(node, by_size, i), range_node_link(next), memory_order_relaxed);
+        atomic_store_explicit(range_prev_link(node, by_size, i), range_node_link(before), memory_order_relaxed);
+        if (next) {
+            atomic_store_explicit(range_prev_link(next, by_size, i), range_node_link(node), memory_order_relaxed);
+        }
+        atomic_store_explicit(range_next_link(before, by_size, i), range_node_link(node), memory_order_relaxed);
+    }
+
+    if (by_size && !atomic_load_explicit(&node->next_size[0], memory_order_relaxed)) {
+        atomic_store_explicit(&list->largest_size, size, memory_order_relaxed);
+    }
+}
+
+// Lock what taking a held node out of both lists touches
+static bool range_plan_remove(range_lock_group_t *group, range_node_t *node) {
+    if (!range_lock_neighbors(group, node, false) || !range_lock_neighbors(group, node, true)) {
+        return false;
+    }
+
+    range_group_add_gone(group, node, true);
+    return true;
+}
+
+// Find and lock the place of a range in the size list
+static bool range_plan_size(range_lock_group_t *group, skiplist_t *list, size_t size, size_t start, uint32_t level, range_node_t **prev_size) {
+    return range_walk(group, list, true, size, start, level, prev_size) && range_lock_next(group, prev_size, level, true);
+}
+
+// Lock what moving a held node to its new size in the size list touches
+static bool range_plan_resize(range_lock_group_t *group, skiplist_t *list, range_node_t *node, size_t size, range_node_t **prev_size) {
+    if (!range_lock_neighbors(group, node, true)) {
+        return false;
+    }
+
+    range_group_add_gone(group, node, false);
+    return range_plan_size(group, list, size, node->start, atomic_load_explicit(&node->level, memory_order_relaxed), prev_size);
+}
+
+// Find and lock the place of a new range right behind a held node, which
+// either stays in front of it or is on its way out. Up to the node's level
+// the ones in front are known, only taller ranges need a walk from the head.
+static bool range_plan_behind(range_lock_group_t *group, skiplist_t *list, range_node_t *node, size_t start, size_t size, range_node_t **prev, range_node_t **prev_size) {
+    uint32_t level = range_level(start);
+
+    if (level > atomic_load_explicit(&node->level, memory_order_relaxed)) {
+        if (!range_walk(group, list, false, 0, start, level, prev)) {
+            return false;
+        }
+    } else {
+        bool gone = range_group_gone(group, node, false);
+        for (uint32_t i = 0; i <= level; ++i) {
+            prev[i] = gone ? range_link_node(atomic_load_explicit(&node->prev[i], memory_order_relaxed)) : node;
+        }
+    }
+
+    return range_lock_next(group, prev, level, false) && range_plan_size(group, list, size, start, level, prev_size);
+}
+
+static void range_remove(skiplist_t *list, range_node_t *node) {
+    // Make sure we don't confuse anyone
+    uint32_t expected = RANGE_MAGIC;
+    if (!atomic_compare_exchange_strong(&node->magic, &expected, 0)) {
+        printf("range_remove: node %p without magic\n", node);
+        exit(1);
+    }
+
+    atomic_fetch_add(&node->dealloc_count, 1);
+    skiplist_set_runs(list, node, 0);
+    skiplist_bin_remove(list, node);
+    range_unlink(list, node, false);
+    range_unlink(list, node, true);
+}
+
+static void range_resize(skiplist_t *list, range_node_t *node, size_t size, range_node_t **prev_size) {
+    skiplist_set_runs(list, node, 0);
+    skiplist_bin_remove(list, node);
+    range_unlink(list, node, true);
+    atomic_store_explicit(&node->size, size, memory_order_relaxed);
+    range_link(list, node, prev_size, true);
+    skiplist_set_runs(list, node, size);
+    skiplist_bin_insert(list, node);
+}
+
+// Write the node of a new range and link it in. Nobody can get to it before
+// the nodes in front of it are let go, it starts out unlocked.
+static void range_place(skiplist_t *list, size_t start, size_t size, size_t epoch, range_node_t **prev, range_node_t **prev_size) {
+    range_node_t *node = range_node_at(start);
+
+    // Only now the node gets written, a purged range merged into the one in
+    // front of it stays clean
+    page_mark_dirty(start, RANGE_NODE_PAGES);
+    atomic_fetch_add(&node->alloc_count, 1);
+
+    atomic_flag_clear_explicit(&node->lock, memory_order_relaxed);
+    node->start = start;
+    node->size  = size;
+    node->epoch = epoch;
+    node->level = range_level(start);
+    node->magic = RANGE_MAGIC;
+
+    // Make sure we don't have any weird pointers on other levels
+    for (uint32_t i = 0; i < SKIPLIST_MAX_LEVEL; ++i) {
+        node->next[i] = 0;
+        node->prev[i] = 0;
+        node->next_size[i] = 0;
+        node->prev_size[i] = 0;
+    }
+
+    range_link(list, node, prev, false);
+    range_link(list, node, prev_size, true);
+    skiplist_set_runs(list, node, size);
+    skiplist_bin_insert(list, node);
+}
+
+#include <signal.h>
+
+// Put a freed range into a shard, merging it with the ones on either side
+static bool skiplist_try_insert(range_lock_group_t *group, skiplist_t *list, size_t start, size_t size, size_t epoch) {
+    uint32_t      level = range_level(start);
+    range_node_t *prev[SKIPLIST_MAX_LEVEL];
+    range_node_t *prev_size[SKIPLIST_MAX_LEVEL];
+
+    if (!range_walk(group, list, false, 0, start, level, prev) || !range_lock_next(group, prev, level, false)) {
+        return false;
+    }
+
+    // The ranges right in front and behind, if they touch this one
+    range_node_t *before = prev[0] != &list->head ? prev[0] : NULL;
+    range_node_t *after  = range_next(group, prev[0], false, 0);
+    if (before && before->start + before->size != start) {
+        before = NULL;
+    }
+    if (after && after->start != start + size) {
+        after = NULL;
+    }
+
+    if (after) {
+        if (!range_plan_remove(group, after)) {
+            return false;
+        }
+        size += after->size;
+        if (after->epoch < epoch) {
+            epoch = after->epoch;
+        }
+    }
+
+    if (before ? !range_plan_resize(group, list, before, before->size + size, prev_size) :
+                 !range_plan_size(group, list, size, start, level, prev_size)) {
+        return false;
+    }
+
+    // Everything is locked, nothing can fail from here on
+    if (after) {
+        range_remove(list, after);
+    }
+    if (before) {
+        if (epoch < before->epoch) {
+            before->epoch = epoch;
+        }
+        range_resize(list, before, before->size + size, prev_size);
+    } else {
+        range_place(list, start, size, epoch, prev, prev_size);
+    }
+    return true;
+}
+
+static void insert_range_sorted(skiplist_t *list, size_t start_index, size_t size, size_t epoch) {
+    range_node_t *node = range_node_at(start_index);
+
+    if (atomic_load(&node->magic) == RANGE_MAGIC) {
+        printf("FATAL: Duplicate free? %p: alloc_count: %i, dealloc_count: %i\n", node, atomic_load(&node->alloc_count), atomic_load(&node->dealloc_count));
+        printf("-----------------------------------\n");
+        print_size_skiplist();
+        printf("-----------------------------------\n");
+        print_index_skiplist();
+        printf("-----------------------------------\n");
+        raise(SIGINT);
+        exit(1);
+        return;
+    }
+
+    range_lock_group_t group;
+    range_group_init(&group);
+    for (uint32_t tries = 0; !skiplist_try_insert(&group, list, start_index, size, epoch); ++tries) {
+        range_group_release(&group);
+        range_group_backoff(tries);
+    }
+    range_group_release(&group);
+}
+
+// Cut count pages starting at index out of a held node, the slivers in front
+// and behind stay free. Returns false without changing anything if a node it
+// needs is busy.
+static bool skiplist_carve(range_lock_group_t *group, skiplist_t *list, range_node_t *node, size_t index, size_t count) {
+    size_t        start = node->start;
+    size_t        end   = node->start + node->size;
+    size_t        epoch = node->epoch;
+    range_node_t *prev_front[SKIPLIST_MAX_LEVEL];
+    range_node_t *prev[SKIPLIST_MAX_LEVEL];
+    range_node_t *prev_size[SKIPLIST_MAX_LEVEL];
+
+    if (index > start ? !range_plan_resize(group, list, node, index - start, prev_front) : !range_plan_remove(group, node)) {
+        return false;
+    }
+    if (end > index + count && !range_plan_behind(group, list, node, index + count, end - (index + count), prev, prev_size)) {
+        return false;
+    }
+
+    if (index > start) {
+        range_resize(list, node, index - start, prev_front);
+    } else {
+        range_remove(list, node);
+    }
+    if (end > index + count) {
+        range_place(list, index + count, end - (index + count), epoch, prev, prev_size);
+    }
+    return true;
+}
+
+// First range of at least size pages in the size list, locked
+static bool skiplist_get_firstfit(range_lock_group_t *group, skiplist_t* list, size_t size, range_node_t **out) {
+    range_node_t *prev[SKIPLIST_MAX_LEVEL];
+    if (!range_walk(group, list, true, size, 0, 0, prev)) {
+        return false;
+    }
+
+    range_node_t *node = range_next(group, prev[0], true, 0);
+    if (node && range_group_lock(group, node) == RANGE_BUSY) {
+        return false;
+    }
+
+    *out = node;
+    return true;
+}
+
+// Tail of the size list, locked
+static bool skiplist_get_largest_node(range_lock_group_t *group, skiplist_t* list, range_node_t **out) {
+    range_node_t *prev[SKIPLIST_MAX_LEVEL];
+    if (!range_walk(group, list, true, SIZE_MAX, SIZE_MAX, 0, prev)) {
+        return false;
+    }
+
+    *out = prev[0] != &list->head ? prev[0] : NULL;
+    return true;
+}
+
+// Lowest address range of at least size pages, walks the index list
+static bool skiplist_get_lowest_fit(range_lock_group_t *group, skiplist_t* list, size_t size, range_node_t **out) {
+    range_node_t *node = &list->head;
+    if (range_group_lock(group, node) == RANGE_BUSY) {
+        return false;
+    }
+
+    do {
+        if (!range_step(group, &node, false)) {
+            return false;
+        }
+    } while (node && atomic_load_explicit(&node->size, memory_order_relaxed) < size);
+
+    *out = node;
+    return true;
+}
+
+// Smallest range that fits, unless the split would leave a sliver behind
+// and one of the next few larger ranges wouldn't. Exact fits and ranges
+// that get handed out whole thanks to the slack are never slivers.
+static bool skiplist_get_bestfit(range_lock_group_t *group, skiplist_t* list, size_t size, size_t slack, range_node_t **out) {
+    range_node_t *first;
+    if (!skiplist_get_firstfit(group, list, size - slack, &first)) {
+        return false;
+    }
+
+    range_node_t *node = first;
+    for (int tries = 0; node && tries < PAGE_PLACEMENT_BEST_TRIES; ++tries) {
+        size_t node_size = atomic_load_explicit(&node->size, memory_order_relaxed);
+        if (node_size < size + slack || node_size - size == 0 || node_size - size >= PAGE_PLACEMENT_SLIVER) {
+            *out = node;
+            return true;
+        }
+
+        range_node_t *next = range_next(group, node, true, 0);
+        if (next && range_group_lock(group, next) == RANGE_BUSY) {
+            return false;
+        }
+        if (node != first) {
+            range_group_drop(group, node);
+        }
+        node = next;
+    }
+
+    if (node && node != first) {
+        range_group_drop(group, node);
+    }
+    *out = first;
+    return true;
+}
+
+static size_t skiplist_get_largest_size(skiplist_t* list) {
+    return atomic_load_explicit(&list->largest_size, memory_order_relaxed);
+}
+
+// Whether none of the count pages starting at index were handed back to the OS
+static bool page_run_dirty(size_t index, size_t count) {
+    size_t local = index & PAGE_REGION_MASK;
+    return page_bitmap_clear_run(&page_region(index)->clean, local, local + count) == count;
+}
+
+static bool skiplist_try_get_pages(range_lock_group_t *group, skiplist_t* list, size_t *size, size_t slack, bool at_end, void **page) {
     //printf("Attempting to find a range of size %zi with slack %zi\n", *size, slack);
-    void* page = NULL;
     range_node_t* current = NULL;
+    bool found;
+
+    *page = NULL;
+    enum page_placement policy = atomic_load_explicit(&placement, memory_order_relaxed);
+    switch (policy) {
+        case PAGE_PLACEMENT_FIRST_FIT:
+        case PAGE_PLACEMENT_KEEP_LOW: found = skiplist_get_lowest_fit(group, list, *size - slack, &current); break;
+        case PAGE_PLACEMENT_BEST_FIT: found = skiplist_get_bestfit(group, list, *size, slack, &current); break;
+        case PAGE_PLACEMENT_WORST_FIT: found = skiplist_get_largest_node(group, list, &current); break;
+        default:
+            if (*size >= pages / 8) {
+                // Worst fit for large allocations
+                found = skiplist_get_largest_node(group, list, &current);
+            } else {
+                // Good fit from the size bins for smaller allocations. Rounding up
+                // skips the bin the request falls into, look there before giving up.
+                found = skiplist_get_binfit(group, list, *size - slack, &current);
+                if (found && !current) {
+                    found = skiplist_get_firstfit(group, list, *size - slack, &current);
+                }
+            }
+            break;
+    }
+
+    if (!found) {
+        return false;
+    }
+    if (!current) {
+        // We didn't find anything
+        return true;
+    }
+
+    // Carving from the back would raise the highest address in use
+    if (policy == PAGE_PLACEMENT_KEEP_LOW) {
+        at_end = false;
+    }
+
+    if (atomic_load_explicit(&current->magic, memory_order_relaxed) != RANGE_MAGIC) {
+        // We hold the node, this list is corrupt
+        printf("skiplist_get_pages: node %p without magic\n", current);
+        exit(1);
+    }
+
+    size_t take = *size;
+    size_t new_size = 0;
+    size_t current_size = atomic_load(&current->size);
+    if (current_size >= take) {
+        if (current_size >= take + slack) {
+            new_size = current_size - take;
+        } else {
+            take = current_size;
+        }
+    } else {
+        if (current_size < take - slack) {
+            //printf("Got range of size %zi, requested %zi slack %zi\n", current->size, take, slack);
+            return true;
+        }
+        take = current_size;
+    }
+
+    // A purged range keeps its first page dirty for the node, pages freed
+    // later and merged in sit at its back. Take from whichever end is still
+    // dirty, so the clean pages stay with the OS for as long as possible.
+    if (!at_end && new_size && policy != PAGE_PLACEMENT_KEEP_LOW && atomic_load_explicit(&clean_pages, memory_order_relaxed) &&
+        !page_run_dirty(current->start, take) && page_run_dirty(current->start + new_size, take)) {
+        at_end = true;
+    }
+
+    size_t index = at_end ? current->start + new_size : current->start;
+    if (!skiplist_carve(group, list, current, index, take)) {
+        return false;
+    }
+
+    *size = take;
+    *page = get_page_by_index(index);
+    return true;
+}
+
+static void* skiplist_get_pages(skiplist_t* list, size_t *size, size_t slack, bool at_end) {
+    range_lock_group_t group;
+    void              *page;
+
+    range_group_init(&group);
+    for (uint32_t tries = 0; !skiplist_try_get_pages(&group, list, size, slack, at_end, &page); ++tries) {
+        range_group_release(&group);
+        range_group_backoff(tries);
+    }
+    range_group_release(&group);
+    return page;
+}
+
+// Insert a freed range, splitting it up at shard boundaries
+static void free_ranges_insert(size_t start_index, size_t size) {
+    while (size) {
+        skiplist_t *list = free_ranges_shard(start_index);
+        size_t      part = list->end - start_index;
+        if (part > size) {
+            part = size;
+        }
+
+        insert_range_sorted(list, start_index, part, atomic_load_explicit(&purge_epoch, memory_order_relaxed));
+
+        start_index += part;
+        size        -= part;
+        atomic_fetch_add_explicit(&purge_pending, part, memory_order_relaxed);
+    }
+
+    page_purge_tick();
+}
+
+// First page index at or after index whose address is aligned to align bytes
+__attribute__((always_inline)) static inline size_t align_page_index(size_t index, size_t align) {
+    uintptr_t page = (uintptr_t)get_page_by_index(index);
+    return index + ((uintptr_t)ALIGN_UP(page, align) - page) / PAGE_SIZE;
+}
+
+// Find the first run of at least want free pages that crosses one or more
+// shard boundaries, or the longest one if there is no such run. The run
+// start is moved up to the requested alignment and the length shrinks with
+// it. Runs never continue from one region into the next. Only reads the
+// cached runs at the shard ends, so the result is a best effort estimate
+// that free_ranges_take_at checks again with the ranges locked.
+static size_t free_ranges_find_run(size_t shards, size_t want, size_t align, size_t *run_start) {
+    size_t best       = 0;
+    size_t best_start = 0;
+    size_t start      = 0;
+    size_t length     = 0;
+
+    for (size_t shard = 0; shard < shards && best < want; ++shard) {
+        skiplist_t *list = &free_ranges[shard];
+        size_t      head = atomic_load_explicit(&list->head_run, memory_order_relaxed);
+
+        if (shard % FREE_RANGE_SHARDS == 0) {
+            length = 0;
+        }
+
+        if (length && head) {
+            length += head;
+
+            size_t aligned = align_page_index(start, align);
+            size_t usable  = aligned - start < length ? length - (aligned - start) : 0;
+            if (usable > best) {
+                best       = usable;
+                best_start = aligned;
+            }
+
+            // The whole shard is free, the run carries on into the next one
+            if (list->first + head == list->end) {
+                continue;
+            }
+        }
+
+        size_t tail = atomic_load_explicit(&list->tail_run, memory_order_relaxed);
+        start       = list->end - tail;
+        length      = tail;
+    }
+
+    *run_start = best_start;
+    return best;
+}
+
+// Find a range in one shard with an aligned run of size pages inside it and
+// carve that out. Walks the size list upwards from the first range that is
+// big enough, so the smallest range that works wins.
+static bool skiplist_try_get_aligned(range_lock_group_t *group, skiplist_t* list, size_t size, size_t align, void **page) {
+    range_node_t *current;
+
+    *page = NULL;
+    if (!skiplist_get_firstfit(group, list, size, &current)) {
+        return false;
+    }
+
+    while (current) {
+        if (atomic_load_explicit(&current->magic, memory_order_relaxed) != RANGE_MAGIC) {
+            printf("skiplist_get_aligned: node %p without magic\n", current);
+            exit(1);
+        }
+
+        size_t index = align_page_index(current->start, align);
+        if (index + size <= current->start + current->size) {
+            if (!skiplist_carve(group, list, current, index, size)) {
+                return false;
+            }
+            *page = get_page_by_index(index);
+            return true;
+        }
+
+        if (!range_step(group, &current, true)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void* skiplist_get_aligned(skiplist_t* list, size_t size, size_t align) {
+    range_lock_group_t group;
+    void              *page;
+
+    range_group_init(&group);
+    for (uint32_t tries = 0; !skiplist_try_get_aligned(&group, list, size, align, &page); ++tries) {
+        range_group_release(&group);
+        range_group_backoff(tries);
+    }
+    range_group_release(&group);
+    return page;
+}
+
+// Lock the ranges the count pages starting at index are made of, one per
+// shard for as far as the free run reaches. *end is where the run stops.
+static bool free_ranges_lock_run(range_lock_group_t *group, size_t index, size_t count, range_node_t **nodes, uint32_t *found, size_t *end) {
+    size_t shard = free_ranges_shard_index(index);
+
+    *found = 0;
+    *end   = index;
+    while (*end < index + count) {
+        skiplist_t   *list = &free_ranges[shard++];
+        range_node_t *prev[SKIPLIST_MAX_LEVEL];
+
+        // Last range starting at or before end
+        if (!range_walk(group, list, false, 0, *end + 1, 0, prev)) {
+            return false;
+        }
+
+        range_node_t *node = prev[0];
+        if (node == &list->head || *end >= node->start + node->size) {
+            range_group_drop(group, node);
+            break;
+        }
+
+        nodes[(*found)++] = node;
+        *end = node->start + node->size;
+        if (*end < list->end) {
+            break; // The run stops inside this shard
+        }
+    }
+
+    return true;
+}
+
+static atomic_flag free_ranges_take_lock = ATOMIC_FLAG_INIT; // One spanning take holding on to its run at a time
+
+// Take the count pages starting at index if they are all free. Once the
+// ranges of the run are locked nobody else can take it, they are carved up
+// one at a time while holding on to the rest. Everyone else lets go when
+// they find a node busy, so waiting for the neighbours can't deadlock.
+static bool free_ranges_take_at(size_t index, size_t count) {
+    if ((index & PAGE_REGION_MASK) + count > page_region(index)->pages) {
+        return false;
+    }
+
+    range_lock_group_t group;
+    range_node_t      *nodes[FREE_RANGE_SHARDS];
+    uint32_t           found;
+    size_t             end;
+
+    SPIN_LOCK_LOCK(free_ranges_take_lock);
+    range_group_init(&group);
+    for (uint32_t tries = 0; !free_ranges_lock_run(&group, index, count, nodes, &found, &end); ++tries) {
+        range_group_release(&group);
+        range_group_backoff(tries);
+    }
+
+    bool taken = end >= index + count;
+    if (taken) {
+        group.kept = group.count;
+        for (uint32_t i = 0; i < found; ++i) {
+            skiplist_t *list = free_ranges_shard(nodes[i]->start);
+            size_t      from = nodes[i]->start > index ? nodes[i]->start : index;
+            size_t      to   = nodes[i]->start + nodes[i]->size;
+            if (to > index + count) {
+                to = index + count;
+            }
+
+            for (uint32_t tries = 0; !skiplist_carve(&group, list, nodes[i], from, to - from); ++tries) {
+                range_group_release(&group);
+                range_group_backoff(tries);
+            }
+            range_group_release(&group);
+        }
+        group.kept = 0;
+    }
+
+    range_group_release(&group);
+    SPIN_LOCK_UNLOCK(free_ranges_take_lock);
+    return taken;
+}
+
+// Slow path for allocations that don't fit inside any one shard. The run is
+// looked up in the cached boundary runs without any lock, then only the
+// ranges it covers are locked, frees everywhere else carry on. Someone else
+// might take the run first, the caller retries.
+static void* free_ranges_get_spanning(size_t size, size_t align) {
+    size_t run_start;
+    if (free_ranges_find_run(free_ranges_count(), size, align, &run_start) < size) {
+        return NULL;
+    }
+
+    if (!free_ranges_take_at(run_start, size)) {
+        return NULL;
+    }
+    return get_page_by_index(run_start);
+}
+
+// Shard to try at step i of a search. First fit and keep low go by address
+// from the lowest shard up, every other policy starts at the home shard.
+__attribute__((always_inline)) static inline size_t free_ranges_search_shard(size_t i, size_t count) {
+    enum page_placement policy = atomic_load_explicit(&placement, memory_order_relaxed);
+    if (policy == PAGE_PLACEMENT_FIRST_FIT || policy == PAGE_PLACEMENT_KEEP_LOW) {
+        return i;
+    }
+    return (free_ranges_home() + i) % count;
+}
+
+static void* free_ranges_get_pages(size_t *size, size_t slack, bool at_end) {
+    size_t wanted = *size;
+    size_t count  = free_ranges_count();
+
+    for (size_t i = 0; i < count; ++i) {
+        void *page = skiplist_get_pages(&free_ranges[free_ranges_search_shard(i, count)], size, slack, at_end);
+        if (page) {
+            return page;
+        }
+        *size = wanted;
+    }
+
+    // With slack any non-empty shard would have done, only exact requests can be helped
+    if (slack) {
+        return NULL;
+    }
+
+    return free_ranges_get_spanning(wanted, PAGE_SIZE);
+}
+
+static void* free_ranges_get_link(size_t size, size_t align, bool at_end) {
+    if (align > PAGE_SIZE) {
+        size_t count = free_ranges_count();
+        for (size_t i = 0; i < count; ++i) {
+            void *page = skiplist_get_aligned(&free_ranges[free_ranges_search_shard(i, count)], size, align);
+            if (page) {
+                return page;
+            }
+        }
+        return free_ranges_get_spanning(size, align);
+    }
+
+    return free_ranges_get_pages(&size, 0, at_end);
+}
+
+size_t get_largest_size() {
+    size_t largest = 0;
+    for (size_t shard = 0; shard < free_ranges_count(); ++shard) {
+        size_t size = skiplist_get_largest_size(&free_ranges[shard]);
+        if (size > largest) {
+            largest = size;
+        }
+    }
+
+    size_t run_start;
+    size_t spanning = free_ranges_find_run(free_ranges_count(), SIZE_MAX, PAGE_SIZE, &run_start);
+    return spanning > largest ? spanning : largest;
+}
+
+static void page_alloc_stats_run(page_alloc_stats_t *out, size_t length) {
+    if (!length) {
+        return;
+    }
+
+    size_t bucket = 0;
+    while (bucket + 1 < PAGE_STATS_RUN_BUCKETS && length >> (bucket + 1)) {
+        ++bucket;
+    }
+
+    ++out->free_run_histogram[bucket];
+    ++out->free_runs;
+    if (length > out->largest_free_run) {
+        out->largest_free_run = length;
+    }
+}
+
+// Snapshot of the allocator state. Ranges are locked one at a time hand over
+// hand and nothing gets printed, so this is fine to call while other threads
+// keep allocating. The numbers are consistent per range, not over the whole snapshot.
+void page_alloc_stats(page_alloc_stats_t *out) {
+    __builtin_memset(out, 0, sizeof(*out));
+
+    uint32_t count = atomic_load_explicit(&page_region_count, memory_order_acquire);
+    for (uint32_t r = 0; r < count; ++r) {
+        out->used_pages += page_bitmap_count(&page_regions[r].used, page_regions[r].pages);
+        out->zero_pages += page_regions[r].pages - page_bitmap_count(&page_regions[r].written, page_regions[r].pages);
+        for (int type = 0; type < ALLOCATOR_TYPES; ++type) {
+            out->type_pages[type] += page_bitmap_count(&page_regions[r].types[type], page_regions[r].pages);
+        }
+    }
+
+    out->pages        = get_pages();
+    out->free_pages   = get_free_pages();
+    out->cached_pages = page_cache_pages();
+    out->reserved_pages = atomic_load_explicit(&reserved_pages, memory_order_relaxed);
+    out->clean_pages  = atomic_load_explicit(&clean_pages, memory_order_relaxed);
+    for (int i = 0; i < QUICKPOOL_DIVISIONS; ++i) {
+        out->quickpool_pages[i] = atomic_load_explicit(&quickpools[0].subpool[i].size, memory_order_relaxed);
+    }
+    out->zero_pool_pages = atomic_load_explicit(&zero_pool.size, memory_order_relaxed);
+    out->quickpool_run_pages = quickpool_run_pages();
+
+    // Ranges are only split at shard boundaries, stitch them back together
+    // here so the histogram shows what a spanning allocation could get
+    size_t run_end    = 0;
+    size_t run_length = 0;
+    for (size_t shard = 0; shard < free_ranges_count(); ++shard) {
+        skiplist_t *list = &free_ranges[shard];
+
+        if (shard % FREE_RANGE_SHARDS == 0) {
+            page_alloc_stats_run(out, run_length);
+            run_length = 0;
+        }
+
+        // A busy range restarts the walk behind the last range counted
+        size_t from = list->first;
+        for (uint32_t tries = 0;; ++tries) {
+            range_lock_group_t group;
+            range_node_t      *prev[SKIPLIST_MAX_LEVEL];
+            range_node_t      *node = NULL;
+
+            range_group_init(&group);
+            bool busy = !range_walk(&group, list, false, 0, from, 0, prev);
+            if (!busy) {
+                node = prev[0];
+                busy = !range_step(&group, &node, false);
+            }
+
+            while (!busy && node) {
+                size_t start = atomic_load(&node->start);
+                size_t size  = atomic_load(&node->size);
+
+                out->free_range_pages += size;
+                if (run_length && start == run_end) {
+                    run_length += size;
+                } else {
+                    page_alloc_stats_run(out, run_length);
+                    run_length = size;
+                }
+                run_end = start + size;
+                from    = start + 1;
+
+                busy = !range_step(&group, &node, false);
+            }
+
+            range_group_release(&group);
+            if (!busy) {
+                break;
+            }
+            range_group_backoff(tries);
+        }
+    }
+    page_alloc_stats_run(out, run_length);
+}
+
+// Insert a sorted list of single pages, merging neighbours into one range first
+static void free_ranges_insert_pages(size_t *indices, size_t count) {
+    size_t i = 0;
+    while (i < count) {
+        skiplist_t *list  = free_ranges_shard(indices[i]);
+        size_t      start = indices[i];
+        size_t      size  = 1;
+        while (i + size < count && indices[i + size] == start + size && start + size < list->end) {
+            ++size;
+        }
+
+        insert_range_sorted(list, start, size, atomic_load_explicit(&purge_epoch, memory_order_relaxed));
+        i += size;
+    }
+
+    atomic_fetch_add_explicit(&purge_pending, count, memory_order_relaxed);
+    page_purge_tick();
+}
+
+// Move up to budget pages from a quickpool division, or the zero pool, back into free_ranges
+static size_t quickpool_return(pool_t *pool, size_t budget) {
+    size_t indices[QUICKPOOL_COALESCE_BUDGET];
+    size_t count;
+
+    if (budget > QUICKPOOL_COALESCE_BUDGET) {
+        budget = QUICKPOOL_COALESCE_BUDGET;
+    }
+
+    void *page = quickpool_pop_batch(pool, budget, &count);
+    for (size_t i = 0; page; ++i) {
+        size_t index = get_page_index(page);
+        void  *next  = quickpool_next(page);
+
+        // Without its link a page from the zero pool is all zeros again
+        quickpool_link(page, NULL);
+        page = next;
+
+        // Pops come back in roughly the order they were pushed, insertion sort is fine
+        size_t j = i;
+        while (j && indices[j - 1] > index) {
+            indices[j] = indices[j - 1];
+            --j;
+        }
+        indices[j] = index;
+    }
+
+    free_ranges_insert_pages(indices, count);
+    return count;
+}
+
+// Size of the next quickpool refill. Called with an alloc_lock held, folds the
+// pops since the last refill into the demand estimate with a weight of 1/4.
+static size_t quickpool_refill_size() {
+    size_t pops   = atomic_exchange_explicit(&quickpool_pops, 0, memory_order_relaxed);
+    size_t demand = (atomic_load_explicit(&quickpool_demand, memory_order_relaxed) * 3 + pops) / 4;
+
+    if (demand > QUICKPOOL_REFILL_MAX) {
+        demand = QUICKPOOL_REFILL_MAX;
+    }
+    if (demand < QUICKPOOL_REFILL_MIN) {
+        demand = QUICKPOOL_REFILL_MIN;
+    }
+
+    atomic_store_explicit(&quickpool_demand, demand, memory_order_relaxed);
+    return demand;
+}
+
+static void quickpool_coalesce() {
+    // Whatever the quickpools hold beyond two refills worth of recent demand
+    // is just sitting there, hand it back so links can use it
+    size_t high_water = atomic_load_explicit(&quickpool_demand, memory_order_relaxed) * 2;
+    size_t total      = 0;
+
+    for (uint32_t i = 0; i < QUICKPOOL_DIVISIONS; ++i) {
+        total += atomic_load_explicit(&quickpools[0].subpool[i].size, memory_order_relaxed);
+    }
+
+    for (uint32_t i = 0; i < QUICKPOOL_DIVISIONS && total > high_water; ++i) {
+        size_t size = atomic_load_explicit(&quickpools[0].subpool[i].size, memory_order_relaxed);
+        if (!size) {
+            continue;
+        }
+
+        size_t excess = total - high_water;
+        if (excess > size) {
+            excess = size;
+        }
+
+        // One thread per division is plenty, everyone else just carries on
+        if (SPIN_LOCK_TRY_LOCK(quickpool_coalescing[i])) {
+            total -= quickpool_return(&quickpools[0].subpool[i], excess);
+            SPIN_LOCK_UNLOCK(quickpool_coalescing[i]);
+        }
+    }
+}
+
+static void quickpool_empty(pool_t *pool) {
+    while (quickpool_return(pool, QUICKPOOL_COALESCE_BUDGET));
+}
+
+// Smallest run pool whose runs hold size pages
+__attribute__((always_inline)) static inline uint32_t quickpool_run_order(size_t size) {
+    uint32_t order = 1;
+    while (((size_t)1 << order) < size) {
+        ++order;
+    }
+    return order;
+}
+
+static void quickpool_push_run(void *ptr, uint32_t order) {
+#ifndef OFF_PAGE_FREE_LISTS
+    page_mark_dirty(get_page_index(ptr), 1);
+#endif
+    quickpool_push_chain(&quickpools[order].subpool[quickpool_division(ptr)], ptr, ptr, 1);
+}
+
+// Split a free range into QUICKPOOL_RUN_REFILL runs of the order, fewer if
+// that is all there is. One thread per order, everyone else takes the skiplist.
+static bool quickpool_refill_runs(uint32_t order) {
+    if (!SPIN_LOCK_TRY_LOCK(quickpool_run_refilling[order])) {
+        return false;
+    }
+
+    size_t run   = (size_t)1 << order;
+    size_t size  = run * QUICKPOOL_RUN_REFILL;
+    void  *range = free_ranges_get_pages(&size, size - run, false);
+    if (range) {
+        size_t runs = size / run;
+        if (size % run) {
+            free_ranges_insert(get_page_index(range) + runs * run, size % run);
+        }
+
+        // Push them as one chain, a single CAS for all of them
+        void *last = (void*)((uintptr_t)range + (runs - 1) * run * PAGE_SIZE);
+        for (void *page = range; page != last; page = (void*)((uintptr_t)page + run * PAGE_SIZE)) {
+#ifndef OFF_PAGE_FREE_LISTS
+            page_mark_dirty(get_page_index(page), 1);
+#endif
+            quickpool_link(page, (void*)((uintptr_t)page + run * PAGE_SIZE));
+        }
+#ifndef OFF_PAGE_FREE_LISTS
+        page_mark_dirty(get_page_index(last), 1);
+#endif
+        quickpool_push_chain(&quickpools[order].subpool[quickpool_division(range)], range, last, runs);
+    }
+
+    SPIN_LOCK_UNLOCK(quickpool_run_refilling[order]);
+    return range != NULL;
+}
+
+// A run of size pages, a power of two up to QUICKPOOL_RUN_MAX_PAGES, without
+// taking any lock. Other sizes stay out of the run pools, the pages a run
+// has beyond them would keep the free ranges around them from coalescing.
+static void *quickpool_alloc_run(size_t size) {
+    uint32_t order = quickpool_run_order(size);
+    void    *run   = NULL;
+
+    uint32_t home  = free_ranges_home();
+
+    for (int attempt = 0; attempt < 2 && !run; ++attempt) {
+        for (uint32_t d = 0; d < QUICKPOOL_DIVISIONS && !run; ++d) {
+            run = quickpool_pop(&quickpools[order].subpool[(home + d) % QUICKPOOL_DIVISIONS]);
+        }
+        if (!run && (attempt || !quickpool_refill_runs(order))) {
+            return NULL;
+        }
+    }
+
+    return run;
+}
+
+// Park a freed link in its run pool if it is exactly a run and the division isn't full yet
+static bool quickpool_free_run(void *ptr, size_t size) {
+    if (size > QUICKPOOL_RUN_MAX_PAGES || (size & (size - 1))) {
+        return false;
+    }
+
+    pool_t *pool = &quickpools[quickpool_run_order(size)].subpool[quickpool_division(ptr)];
+    if (atomic_load_explicit(&pool->size, memory_order_relaxed) >= QUICKPOOL_RUN_HIGH_WATER) {
+        return false;
+    }
+
+    quickpool_push_run(ptr, quickpool_run_order(size));
+    return true;
+}
+
+// Hand every run of an order back to free_ranges
+static void quickpool_empty_runs(uint32_t order) {
+    for (uint32_t i = 0; i < QUICKPOOL_DIVISIONS; ++i) {
+        size_t count;
+        void  *run;
+        while ((run = quickpool_pop_batch(&quickpools[order].subpool[i], QUICKPOOL_COALESCE_BUDGET, &count))) {
+            while (run) {
+                void *next = quickpool_next(run);
+                free_ranges_insert(get_page_index(run), (size_t)1 << order);
+                run = next;
+            }
+        }
+    }
+}
+
+static size_t quickpool_run_pages() {
+    size_t total = 0;
+    for (uint32_t order = 1; order <= QUICKPOOL_POOLS; ++order) {
+        for (uint32_t i = 0; i < QUICKPOOL_DIVISIONS; ++i) {
+            total += atomic_load_explicit(&quickpools[order].subpool[i].size, memory_order_relaxed) << order;
+        }
+    }
+    return total;
+}
+
+void quickpool_destroy(size_t size) {
+    (void)size; // unused right now
+
+    page_cache_drain_all();
+    for (uint32_t order = 1; order <= QUICKPOOL_POOLS; ++order) {
+        quickpool_empty_runs(order);
+    }
+    for (uint32_t i = 0; i < QUICKPOOL_DIVISIONS; ++i) {
+        quickpool_empty(&quickpools[0].subpool[i]);
+    }
+    quickpool_empty(&zero_pool);
+}
+
+#ifdef BADGEROS_KERNEL
+// Nobody to hand pages back to in the kernel, the decay is off anyway
+static size_t page_purge_now_ms() {
+    return 0;
+}
+
+static bool page_purge_advise(void *start, size_t count) {
+    (void)start;
+    (void)count;
+    return false;
+}
+#else
+static size_t page_purge_now_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (size_t)now.tv_sec * 1000 + (size_t)now.tv_nsec / 1000000;
+}
+
+static bool page_purge_advise(void *start, size_t count) {
+    return !madvise(start, count * PAGE_SIZE, PAGE_PURGE_ADVICE);
+}
+#endif
+
+// Pages a purge takes out of free_ranges at a time, nobody can allocate them
+// while they are handed back to the OS
+#define PAGE_PURGE_BATCH 1024
+
+// Hand up to budget dirty pages of a run that was taken out of free_ranges
+// back to the OS
+static size_t page_purge_run(size_t index, size_t count, size_t budget) {
+    page_region_t *region = page_region(index);
+    size_t         local  = index & PAGE_REGION_MASK;
+    size_t         end    = local + count;
+    size_t         purged = 0;
+
+    while (local < end && purged < budget) {
+        local += page_bitmap_set_run(&region->clean, local, end);
+
+        size_t dirty = page_bitmap_clear_run(&region->clean, local, end);
+        if (dirty > budget - purged) {
+            dirty = budget - purged;
+        }
+        if (!dirty || !page_purge_advise(region->pages_start + local * PAGE_SIZE, dirty)) {
+            break;
+        }
+
+        page_bitmap_update(&region->clean, local, dirty, true);
+        if (region->purge_zeroes) {
+            page_bitmap_update(&region->written, local, dirty, false);
+        }
+        atomic_fetch_add(&clean_pages, dirty);
+        purged += dirty;
+        local  += dirty;
+    }
+
+    return purged;
+}
+
+// Carve the next run worth purging at or after *from out of a shard, starting
+// at its first dirty page and at most PAGE_PURGE_BATCH long. Unless the node
+// lives off page the first page of a range holds it and has to stay. Returns
+// false if a node it needs is busy, *detached tells whether it found a run.
+static bool skiplist_purge_detach(range_lock_group_t *group, skiplist_t *list, size_t *from, size_t max_epoch, size_t *start, size_t *count, size_t *epoch, bool *detached) {
+    *detached = false;
+    if (*from >= list->end) {
+        return true;
+    }
+
+    // Last range starting at or before from, or the first one after it if that one ends in front of from
+    range_node_t *prev[SKIPLIST_MAX_LEVEL];
+    if (!range_walk(group, list, false, 0, *from + 1, 0, prev)) {
+        return false;
+    }
+    range_node_t *node = prev[0];
+    if ((node == &list->head || node->start + node->size <= *from) && !range_step(group, &node, false)) {
+        return false;
+    }
+
+    while (node) {
+        if (node->size > RANGE_NODE_PAGES && node->epoch <= max_epoch) {
+            page_region_t *region = page_region(node->start);
+            size_t         base   = node->start & ~PAGE_REGION_MASK;
+            size_t         first  = node->start + RANGE_NODE_PAGES > *from ? node->start + RANGE_NODE_PAGES : *from;
+            size_t         end    = node->start + node->size;
+
+            first += page_bitmap_set_run(&region->clean, first - base, end - base);
+            if (first < end) {
+                size_t run   = end - first < PAGE_PURGE_BATCH ? end - first : PAGE_PURGE_BATCH;
+                size_t freed = node->epoch;
+                if (!skiplist_carve(group, list, node, first, run)) {
+                    return false;
+                }
+
+                *start    = first;
+                *count    = run;
+                *epoch    = freed;
+                *from     = first + run;
+                *detached = true;
+                return true;
+            }
+        }
+
+        if (!range_step(group, &node, false)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Purge up to budget pages from ranges freed in max_epoch or before. A run is
+// carved out with only its range and neighbours locked, purged without any
+// lock and merged back in, so frees and allocations carry on while the OS
+// does its work.
+static size_t free_ranges_purge(size_t budget, size_t max_epoch) {
+    size_t purged = 0;
+
+    for (size_t shard = 0; shard < free_ranges_count() && purged < budget; ++shard) {
+        skiplist_t *list = &free_ranges[shard];
+        size_t      from = list->first;
+
+        while (purged < budget) {
+            range_lock_group_t group;
+            size_t             start, count, epoch;
+            bool               detached;
+
+            range_group_init(&group);
+            for (uint32_t tries = 0; !skiplist_purge_detach(&group, list, &from, max_epoch, &start, &count, &epoch, &detached); ++tries) {
+                range_group_release(&group);
+                range_group_backoff(tries);
+            }
+            range_group_release(&group);
+            if (!detached) {
+                break;
+            }
+
+            purged += page_purge_run(start, count, budget - purged);
+            insert_range_sorted(list, start, count, epoch);
+        }
+    }
+
+    return purged;
+}
+
+// Share of the pages freed age epochs ago that may still be dirty, out of
+// PAGE_PURGE_EPOCHS^3. That is 1 - smoothstep(age / PAGE_PURGE_EPOCHS).
+__attribute__((always_inline)) static inline uint64_t page_purge_decay_share(uint64_t age) {
+    return (PAGE_PURGE_EPOCHS - age) * (PAGE_PURGE_EPOCHS - age) * (PAGE_PURGE_EPOCHS + 2 * age);
+}
+
+// Catch up with the clock and purge the dirty pages in free_ranges the curve
+// doesn't allow for anymore. Called with purge_lock held.
+static size_t page_purge_decay(size_t decay) {
+    size_t clock = page_purge_now_ms() / ((decay + PAGE_PURGE_EPOCHS - 1) / PAGE_PURGE_EPOCHS);
+    if (clock == purge_clock) {
+        return 0;
+    }
+
+    // After the decay time changed the clock may run backwards, count that as a single step
+    size_t last  = atomic_load_explicit(&purge_epoch, memory_order_relaxed);
+    size_t epoch = last + (clock > purge_clock ? clock - purge_clock : 1);
+    purge_clock  = clock;
+
+    // Epochs that went by without a tick didn't see any frees
+    for (size_t e = last + 1; e <= epoch && e <= last + PAGE_PURGE_EPOCHS; ++e) {
+        purge_epoch_pages[e % PAGE_PURGE_EPOCHS] = 0;
+    }
+    purge_epoch_pages[epoch % PAGE_PURGE_EPOCHS] += atomic_exchange_explicit(&purge_pending, 0, memory_order_relaxed);
+    atomic_store_explicit(&purge_epoch, epoch, memory_order_relaxed);
+
+    uint64_t limit = 0;
+    for (size_t age = 0; age < PAGE_PURGE_EPOCHS; ++age) {
+        limit += purge_epoch_pages[(epoch - age) % PAGE_PURGE_EPOCHS] * page_purge_decay_share(age);
+    }
+    limit /= PAGE_PURGE_EPOCHS * PAGE_PURGE_EPOCHS * PAGE_PURGE_EPOCHS;
+
+    // free_pages covers the quickpools, run pools and the zero pool too, their pages can't be purged.
+    // Reserved pages are left where they are until they get allocated, they can.
+    size_t dirty = atomic_load(&free_pages) + atomic_load_explicit(&reserved_pages, memory_order_relaxed);
+    for (int i = 0; i < QUICKPOOL_DIVISIONS; ++i) {
+        size_t size = atomic_load_explicit(&quickpools[0].subpool[i].size, memory_order_relaxed);
+        dirty = dirty > size ? dirty - size : 0;
+    }
+    size_t zero = atomic_load_explicit(&zero_pool.size, memory_order_relaxed) + quickpool_run_pages();
+    dirty = dirty > zero ? dirty - zero : 0;
+    size_t clean = atomic_load_explicit(&clean_pages, memory_order_relaxed);
+    dirty = dirty > clean ? dirty - clean : 0;
+
+    if (dirty <= limit) {
+        return 0;
+    }
+
+    // Leave ranges alone that were freed after the last step, they didn't sit around for a full epoch yet
+    return free_ranges_purge(dirty - limit, last ? last - 1 : 0);
+}
+
+// Cheap enough for every free_ranges insert, only every so often one of them
+// looks at the clock and only one thread at a time does the purging
+static void page_purge_tick() {
+    if ((atomic_fetch_add_explicit(&purge_ticks, 1, memory_order_relaxed) + 1) % PAGE_PURGE_TICK_INTERVAL) {
+        return;
+    }
+
+    size_t decay = atomic_load_explicit(&purge_decay_ms, memory_order_relaxed);
+    if (decay == PAGE_PURGE_NEVER || !SPIN_LOCK_TRY_LOCK(purge_lock)) {
+        return;
+    }
+
+    if (decay) {
+        page_purge_decay(decay);
+    } else {
+        free_ranges_purge(SIZE_MAX, SIZE_MAX);
+    }
+    SPIN_LOCK_UNLOCK(purge_lock);
+}
+
+// Meant to be called once at init, switching later is fine but ranges that
+// were placed under the old policy stay where they are
+bool page_alloc_set_placement(enum page_placement policy) {
+    if ((unsigned)policy >= PAGE_PLACEMENTS) {
+        return false;
+    }
+
+    atomic_store(&placement, policy);
+    return true;
+}
+
+// Free pages get handed back to the OS over about ms milliseconds, 0 does
+// that right away and PAGE_PURGE_NEVER keeps them
+void page_alloc_set_purge_decay(size_t ms) {
+    SPIN_LOCK_LOCK(purge_lock);
+    // Epochs change length, start the curve over
+    for (size_t i = 0; i < PAGE_PURGE_EPOCHS; ++i) {
+        purge_epoch_pages[i] = 0;
+    }
+    atomic_store(&purge_decay_ms, ms);
+    SPIN_LOCK_UNLOCK(purge_lock);
+}
+
+// Take a decay step now rather than waiting for the next tick, or with all
+// hand every free page back regardless of the curve. Returns the pages purged.
+size_t page_alloc_purge(bool all) {
+    size_t decay  = atomic_load(&purge_decay_ms);
+    size_t purged = 0;
+
+    if (all) {
+        // Everything parked in the caches and quickpools can go as well
+        quickpool_destroy(0);
+    }
+
+    SPIN_LOCK_LOCK(purge_lock);
+    if (all || !decay) {
+        purged = free_ranges_purge(SIZE_MAX, SIZE_MAX);
+    } else if (decay != PAGE_PURGE_NEVER) {
+        purged = page_purge_decay(decay);
+    }
+    SPIN_LOCK_UNLOCK(purge_lock);
+
+    return purged;
+}
+
+// Pages page_alloc_prezero() keeps zeroed ahead of time, 0 turns the pool off
+// and hands whatever it holds back
+void page_alloc_set_zero_pool(size_t pages) {
+    atomic_store(&zero_pool_target, pages);
+    if (!pages) {
+        quickpool_empty(&zero_pool);
+    }
+}
+
+// Idle time work for the kernel idle loop or a background thread: top the
+// zero pool up to its target, zeroing at most budget pages. Pages that are
+// zero already are taken as is. Returns the pages added to the pool.
+size_t page_alloc_prezero(size_t budget) {
+    if (!SPIN_LOCK_TRY_LOCK(zero_lock)) {
+        return 0;
+    }
+
+    size_t added = 0;
+    while (added < budget) {
+        size_t target = atomic_load_explicit(&zero_pool_target, memory_order_relaxed);
+        size_t have   = atomic_load_explicit(&zero_pool.size, memory_order_relaxed);
+        if (have >= target) {
+            break;
+        }
+
+        size_t size = target - have < budget - added ? target - have : budget - added;
+        void  *range = free_ranges_get_pages(&size, size - 1, true);
+        if (!range) {
+            break;
+        }
+
+        // Nobody will look at these for a while, keep them out of the cache
+        size_t         index  = get_page_index(range);
+        page_region_t *region = page_region(index);
+        size_t         local  = index & PAGE_REGION_MASK;
+        size_t         end    = local + size;
+        while (local < end) {
+            local += page_bitmap_clear_run(&region->written, local, end);
+
+            size_t written = page_bitmap_set_run(&region->written, local, end);
+            if (written) {
+                intr_stream_zero(region->pages_start + local * PAGE_SIZE, written * PAGE_SIZE);
+                page_bitmap_update(&region->written, local, written, false);
+            }
+            local += written;
+        }
+
+        // The links go in on top of the zeros, popping a page clears its link again
+        quickpool_push(&zero_pool, range, size);
+        added += size;
+    }
+
+    SPIN_LOCK_UNLOCK(zero_lock);
+    return added;
+}
+
+// Shrinkers run from inside allocations and page_alloc_reclaim_poll(), they
+// may free but must not allocate. They are never removed, there are only so many caches to shrink.
+bool page_alloc_register_shrinker(page_shrinker_t shrink, void *arg) {
+    SPIN_LOCK_LOCK(shrinker_lock);
+    uint32_t count = atomic_load_explicit(&page_shrinker_count, memory_order_relaxed);
+    if (count >= PAGE_SHRINKERS) {
+        SPIN_LOCK_UNLOCK(shrinker_lock);
+        return false;
+    }
+
+    page_shrinkers[count].shrink = shrink;
+    page_shrinkers[count].arg    = arg;
+    atomic_store_explicit(&page_shrinker_count, count + 1, memory_order_release);
+    SPIN_LOCK_UNLOCK(shrinker_lock);
+    return true;
+}
 
-    if (*size >= pages / 8) {
-        // Worst fit for large allocations
-        current = skiplist_get_largest_node(list);
-    } else {
-        // Best fit for smaller allocations
-        current = skiplist_get_firstfit(list, *size - slack);
+bool page_alloc_set_watermarks(size_t min, size_t low, size_t high) {
+    if (min > low || low > high) {
+        return false;
     }
 
-    if (!current || current == &list->head) {
-        // We didn't find anything
-        //return NULL;
-        goto out;
+    atomic_store(&watermark_min, min);
+    atomic_store(&watermark_low, low);
+    atomic_store(&watermark_high, high);
+    return true;
+}
+
+// Get back to target free pages, cheapest first: the caches and quickpools
+// go back to free_ranges so links can use them, then empty slab pages,
+// then the shrinkers in the order they were registered. Returns the pages
+// freed, 0 if another thread is reclaiming already.
+size_t page_alloc_reclaim(size_t target) {
+    if (!SPIN_LOCK_TRY_LOCK(reclaim_lock)) {
+        return 0;
     }
+    atomic_store_explicit(&reclaim_pending, false, memory_order_relaxed);
 
-    if (atomic_load_explicit(&current->magic, memory_order_relaxed) != RANGE_MAGIC) {
-        // Someone raced us here, retr
-        SPIN_LOCK_UNLOCK(list->write_lock);
-        goto start;
+    size_t before = get_free_pages();
+    quickpool_destroy(0);
+    if (get_free_pages() < target) {
+        deallocate_inactive();
     }
 
-    page = ALIGN_PAGE_DOWN(current);
-    size_t new_size = 0;
-    size_t current_size = atomic_load(&current->size);
-    if (current_size >= *size) {
-        if (current_size >= *size + slack) {
-            new_size = current_size - *size;
-        } else {
-            *size = current_size;
-        } 
-    } else {
-        if (current_size < *size - slack) {
-            //printf("Got range of size %zi, requested %zi slack %zi\n", current->size, *size, slack);
-            page = NULL;
-            goto out;
+    uint32_t count = atomic_load_explicit(&page_shrinker_count, memory_order_acquire);
+    for (uint32_t i = 0; i < count; ++i) {
+        size_t free = get_free_pages();
+        if (free >= target) {
+            break;
         }
-        *size = current_size;
+        page_shrinkers[i].shrink(page_shrinkers[i].arg, target - free);
     }
 
-    void* new_node = NULL;
-    if (at_end) {
-        page = (void*)((uintptr_t)page + (PAGE_SIZE * new_size));
-        if (new_size) {
-            //print_size_skiplist();
-            reinsert_node_size(list, current, new_size);
-            //print_size_skiplist();
+    size_t after = get_free_pages();
+    SPIN_LOCK_UNLOCK(reclaim_lock);
+    return after > before ? after - before : 0;
+}
 
-            goto out;
-        }
-    } else {
-        new_node = (void*)((uintptr_t)page + (PAGE_SIZE * *size));
-        if (new_size) {
-            insert_range_sorted(list, new_node, get_page_index(new_node), new_size, false);
-        }
+// Called after every allocation that touched free_pages, a couple of loads unless it went below low
+static void page_watermark_check() {
+    size_t free = atomic_load_explicit(&free_pages, memory_order_relaxed);
+    if (free >= atomic_load_explicit(&watermark_low, memory_order_relaxed)) {
+        return;
     }
 
-    if (!skip_list_remove((void*)current)) {
-        printf("skip_list_remove failed during allocation\n");
-        exit(1);
+    if (free < atomic_load_explicit(&watermark_min, memory_order_relaxed)) {
+        page_alloc_reclaim(atomic_load_explicit(&watermark_high, memory_order_relaxed));
+    } else {
+        atomic_store_explicit(&reclaim_pending, true, memory_order_relaxed);
     }
-
-    // printf("Found range of size %zi at index %zi in a block of %zi %p\n", size, ((range_node_t *)current->next[0])->start, ((range_node_t *)current->next[0])-size, node);
-
-out:
-    SPIN_LOCK_UNLOCK(list->write_lock);
-    return page;
 }
 
-void quickpool_destroy(size_t size) {
-    (void)size; // unused right now
-    
-    for (uint32_t i = 0; i < QUICKPOOL_DIVISIONS; ++i) {
-        void *ptr;
-        while((ptr = quickpool_pop(&quickpools[0].subpool[i]))) {
-            insert_range_sorted(&free_ranges, ptr, get_page_index(ptr), 1, true);
-        }
+// Runs the reclaim an allocation below low asked for, meant for an idle loop
+// or a housekeeping thread. Frees never reclaim themselves, so what a free
+// costs doesn't depend on how much the shrinkers have to do. Returns the
+// pages freed, 0 if there was nothing to do.
+size_t page_alloc_reclaim_poll() {
+    if (!atomic_load_explicit(&reclaim_pending, memory_order_relaxed)) {
+        return 0;
     }
+    return page_alloc_reclaim(atomic_load_explicit(&watermark_high, memory_order_relaxed));
 }
 
-static void quickpool_empty(uint32_t division) {
-    void *ptr;
-    size_t count = 0;
-    while((ptr = quickpool_pop(&quickpools[0].subpool[division]))) {
-        SPIN_LOCK_LOCK(free_ranges.write_lock);
-        insert_range_sorted(&free_ranges, ptr, get_page_index(ptr), 1, true);
-        ++count;
-        SPIN_LOCK_UNLOCK(free_ranges.write_lock);
+// Set up the next region in the table, the metadata is carved from its start
+// The page table and link sizes are left alone, both are written when a page
+// is handed out and never read before that. Only the bitmaps have to start
+// out cleared, which zeroed memory already is. Without that every page
+// starts out as written.
+static bool page_region_init(uint8_t *start, uint8_t *end, bool zeroed) {
+    uint32_t region_index = atomic_load_explicit(&page_region_count, memory_order_relaxed);
+    if (region_index >= PAGE_REGIONS) {
+        return false;
     }
 
-    //printf("Emptied %zi items from quickpool %i\n", count, division);
-}
-
-void page_alloc_init(void *start, void *end) {
-    mem_start              = (uint8_t *)start;
-    mem_end                = (uint8_t *)end;
-    total_size             = (size_t)end - (size_t)start;
-    quickpool_segment_size = (total_size + QUICKPOOL_DIVISIONS - 1) / QUICKPOOL_DIVISIONS;
+    page_region_t *region    = &page_regions[region_index];
+    uint8_t       *first_page = ALIGN_PAGE_UP(start);
+    uint8_t       *pages_end  = ALIGN_PAGE_DOWN(end);
+    if (pages_end <= first_page) {
+        return false;
+    }
 
-    uint8_t *first_page    = ALIGN_PAGE_UP(mem_start);
-    pages_end              = ALIGN_PAGE_DOWN((mem_end));
-    pages                  = (((size_t)pages_end) - ((size_t)first_page)) / PAGE_SIZE;
+    size_t region_pages    = (((size_t)pages_end) - ((size_t)first_page)) / PAGE_SIZE;
+    size_t page_table_size = region_pages;
+    size_t link_sizes_size = region_pages * sizeof(*region->link_sizes);
+    size_t bitmap_size     = page_bitmap_size(region_pages) * (3 + ALLOCATOR_TYPES);
+#ifdef OFF_PAGE_FREE_LISTS
+    size_t nodes_size      = region_pages * (sizeof(range_node_t) + sizeof(node_t));
+#else
+    size_t nodes_size      = 0;
+#endif
 
-    size_t page_table_size = pages;
+    region->page_table   = start;
+    region->link_sizes   = ALIGN_UP(region->page_table + page_table_size, sizeof(*region->link_sizes));
+    uint8_t *bitmaps     = ALIGN_UP(((char *)region->link_sizes) + link_sizes_size, BITMAP_WORD_BYTES);
+    uint8_t *nodes       = ALIGN_UP(bitmaps + bitmap_size, _Alignof(range_node_t));
+#ifdef OFF_PAGE_FREE_LISTS
+    region->range_nodes     = (range_node_t *)nodes;
+    region->quickpool_nodes = (node_t *)(region->range_nodes + region_pages);
+#endif
+    region->pages_start  = ALIGN_PAGE_UP(nodes + nodes_size);
+    region->pages_end   = pages_end;
+    if (region->pages_start >= pages_end) {
+        return false;
+    }
 
-    page_table             = mem_start;
-    pages_start            = ALIGN_PAGE_UP(((char *)page_table) + page_table_size);
+    region->pages       = (((size_t)pages_end) - ((size_t)region->pages_start)) / PAGE_SIZE; // Need to recaculate the number of pages now
+    region->shard_pages = (region->pages + FREE_RANGE_SHARDS - 1) / FREE_RANGE_SHARDS;
 
-    pages = (((size_t)pages_end) - ((size_t)pages_start)) / PAGE_SIZE; // Need to recaculate the number of pages now
-    free_pages = pages;
+    page_bitmap_initialize(&region->used, (bitmap_word_atomic *)bitmaps, region_pages, zeroed);
+    for (int type = 0; type < ALLOCATOR_TYPES; ++type) {
+        page_bitmap_initialize(&region->types[type], (bitmap_word_atomic *)(bitmaps + page_bitmap_size(region_pages) * (1 + type)), region_pages, zeroed);
+    }
+    page_bitmap_initialize(&region->clean, (bitmap_word_atomic *)(bitmaps + page_bitmap_size(region_pages) * (1 + ALLOCATOR_TYPES)), region_pages, zeroed);
+    page_bitmap_initialize(&region->written, (bitmap_word_atomic *)(bitmaps + page_bitmap_size(region_pages) * (2 + ALLOCATOR_TYPES)), region_pages, zeroed);
+    if (!zeroed) {
+        // Nothing is known about the contents, zeroed memory starts out all zero
+        page_bitmap_update(&region->written, 0, region->pages, true);
+    }
+    region->purge_zeroes = zeroed && PAGE_PURGE_ZEROES;
+
+    size_t base = (size_t)region_index << PAGE_REGION_INDEX_BITS;
+    for (int shard = 0; shard < FREE_RANGE_SHARDS; ++shard) {
+        skiplist_t *list  = &free_ranges[region_index * FREE_RANGE_SHARDS + shard];
+        size_t      first = (size_t)shard * region->shard_pages;
+        size_t      last  = first + region->shard_pages;
+        list->first = base + (first < region->pages ? first : region->pages);
+        list->end   = base + (last < region->pages ? last : region->pages);
+    }
 
-    page_table_initialize();
-    insert_range_sorted(&free_ranges, (range_node_t*)pages_start, 0, pages, false);
-    print_size_skiplist();
+    // Publish the region before its pages become visible to anyone
+    atomic_store_explicit(&page_region_count, region_index + 1, memory_order_release);
+    free_ranges_insert(base, region->pages);
+    atomic_fetch_add(&pages, region->pages);
+    atomic_fetch_add(&free_pages, region->pages);
 
-#ifndef BADGEROS_KERNEL
-    size_t waste = (((size_t)pages_start - (size_t)mem_start)) - (page_table_size);
+#if !defined(BADGEROS_KERNEL) && defined(PAGE_ALLOC_DEBUG)
+    size_t waste = (((size_t)region->pages_start - (size_t)start)) - (page_table_size + link_sizes_size + bitmap_size + nodes_size);
 
     printf(
-        "Memory starts at: %p, Memory ends at: %p, First page at: %p, "
-        "total_pages: %zi, page_table_size: %zi, waste: %zi, usable memory: %zi\n",
+        "Region %i starts at: %p, ends at: %p, First page at: %p, "
+        "total_pages: %zi, page_table_size: %zi, link_sizes_size: %zi, bitmap_size: %zi, nodes_size: %zi, waste: %zi, usable memory: %zi\n",
+        region_index,
         start,
         end,
-        pages_start,
-        pages,
+        region->pages_start,
+        region->pages,
         page_table_size,
+        link_sizes_size,
+        bitmap_size,
+        nodes_size,
         waste,
-        pages * PAGE_SIZE
+        region->pages * PAGE_SIZE
     );
 #endif
+    return true;
 }
 
-#define MAX_SIZE_T_BITS (sizeof(size_t) * 8)
-#define MAX_ENCODED_PAGES (MAX_SIZE_T_BITS / 4)
+static bool page_alloc_add(void *start, void *end, bool zeroed) {
+    uint8_t *current = start;
+    bool     added   = false;
 
-static inline uint8_t encode_link_size(size_t allocation_size, size_t chunk_index) {
-    if (allocation_size >= 2 && allocation_size <= 16) {
-        if (chunk_index == 0) {
-            return (uint8_t)(allocation_size - 2);  // 0 represents size 1, 1 represents size 2, ..., 15 represents size 16
-        } else {
-            return 0;
+    SPIN_LOCK_LOCK(region_lock);
+    // Anything larger than a region index window gets split over several regions
+    while ((uint8_t *)end > current) {
+        uint8_t *chunk_end = end;
+        if ((size_t)((uint8_t *)end - current) > PAGE_REGION_MAX_PAGES * PAGE_SIZE) {
+            chunk_end = current + PAGE_REGION_MAX_PAGES * PAGE_SIZE;
         }
-    } else {
-        if (chunk_index == 0) {
-            return 0xF;  // Sentinel value
-        } else {
-            return (allocation_size >> (4 * (chunk_index - 1))) & 0xF;
+
+        if (!page_region_init(current, chunk_end, zeroed)) {
+            break;
         }
+        added   = true;
+        current = chunk_end;
     }
+    SPIN_LOCK_UNLOCK(region_lock);
+
+    return added;
 }
 
-void *page_alloc_link(size_t size) {
+bool page_alloc_add_region(void *start, void *end) {
+    return page_alloc_add(start, end, false);
+}
+
+// For memory that is known to read as zero, fresh anonymous mappings or bss,
+// this skips clearing the bitmaps and makes adding a region independent of its size
+bool page_alloc_add_zeroed_region(void *start, void *end) {
+    return page_alloc_add(start, end, true);
+}
+
+void page_alloc_init(void *start, void *end) {
+    page_alloc_add_region(start, end);
+#ifdef PAGE_ALLOC_DEBUG
+    print_size_skiplist();
+#endif
+}
+
+// Same as page_alloc_init() for memory known to read as zero, like calloc()
+// or a fresh anonymous mapping. Setting up the bitmaps is then O(1).
+void page_alloc_init_zeroed(void *start, void *end) {
+    page_alloc_add_zeroed_region(start, end);
+#ifdef PAGE_ALLOC_DEBUG
+    print_size_skiplist();
+#endif
+}
+
+static void page_link_mark(size_t index, size_t size) {
+    for(size_t i = 0; i < size; ++i) {
+        set_page_type_data(index + i, ALLOCATOR_PAGE_LINK, 0);
+    }
+}
+
+static bool page_link_head(size_t index) {
+    return get_page_type_data(index) == type_data_pack(ALLOCATOR_PAGE_LINK, PAGE_LINK_HEAD);
+}
+
+static void *page_alloc_link_internal(size_t size, size_t align, bool zeroed) {
     if (size < 2) {
         return NULL;
     }
 
+    if (align & (align - 1)) {
+        return NULL;
+    }
+    if (align < PAGE_SIZE) {
+        align = PAGE_SIZE;
+    }
+
     //printf("Allocating a range of size %zi\n", size);
 
     uint8_t tries = 0;
-start:
-    if (atomic_load(&free_pages) < size) {
-        return NULL;
+    bool reclaimed = false;
+    // The pages are accounted for before looking for them, reserved ones are off limits
+    while (!page_claim(size, false)) {
+        if (reclaimed || !page_alloc_reclaim(size + atomic_load_explicit(&watermark_high, memory_order_relaxed))) {
+            return NULL;
+        }
+        reclaimed = true;
     }
+start:
 
-    SPIN_LOCK_LOCK(alloc_lock);
-    size_t new_size = size;
-    void* range = skiplist_get_pages(&free_ranges, &new_size, 0, false);
+    // Short links come from the run pools without any lock, everything
+    // else only locks the shards we look at so frees elsewhere carry on
+    void* range = NULL;
+    if (size <= QUICKPOOL_RUN_MAX_PAGES && !(size & (size - 1)) && align == PAGE_SIZE) {
+        range = quickpool_alloc_run(size);
+    }
+    if (!range) {
+        range = free_ranges_get_link(size, align, false);
+    }
     //printf("Range first try: %p\n", range);
     if (!range) {
         //printf("Got no range, emptying quickpools\n");
+        page_cache_drain_all();
+        for (uint32_t order = 1; order <= QUICKPOOL_POOLS; ++order) {
+            quickpool_empty_runs(order);
+        }
         for (int i = QUICKPOOL_DIVISIONS - 1; i >= 0; --i) {
             //printf("-------------- Emptying quickpool %i\n", i);
             //print_size_skiplist();
-            quickpool_empty(i);
+            quickpool_empty(&quickpools[0].subpool[i]);
             //printf("-------------- Emptying quickpool %i after:\n", i);
             //print_size_skiplist();
             //printf("----------------------------------------\n");
 
-            new_size = size;
-            range = skiplist_get_pages(&free_ranges, &new_size, 0, true);
+            range = free_ranges_get_link(size, align, true);
             if (range) {
                 break;
             }
         }
     }
 
+    // Last resort, the zero pool goes back to free_ranges too. Its pages stay zero in there.
+    if (!range) {
+        quickpool_empty(&zero_pool);
+        range = free_ranges_get_link(size, align, true);
+    }
+
     if (!range) {
         if (tries > 2) {
+            // Whatever the shrinkers free might just be enough
+            if (!reclaimed) {
+                reclaimed = true;
+                tries     = 0;
+                page_alloc_reclaim(size + atomic_load_explicit(&watermark_high, memory_order_relaxed));
+                goto start;
+            }
             //printf("Got no range after 5 tries\n");
-            goto out;
+            atomic_fetch_add(&free_pages, size);
+            return NULL;
         } else {
             ++tries;
             //printf("Got no range after %i tries, retrying\n", tries);
-            SPIN_LOCK_UNLOCK(alloc_lock);
             DELAY(tries);
             goto start;
         }
@@ -725,95 +3006,207 @@ start:
 
     //printf("Got a range of size %zi\n", size);
 
-    for(size_t i = 0; i < size; ++i) {
-        void* page = (void*)((uintptr_t)range + (i * PAGE_SIZE));
-        size_t page_index = get_page_index(page);
-        uint8_t data = encode_link_size(size, i);
-        if (i <= MAX_ENCODED_PAGES) {
-            //printf("Setting page data to %X for size %zi:%zi page_index: %zi\n", data, i, size, page_index);
-        }
-        set_page_type_data(page_index, ALLOCATOR_PAGE_LINK, data);
+    size_t head_index = get_page_index(range);
+    if (zeroed) {
+        // Before page_mark_used() forgets which of them are zero already
+        page_zero_run(head_index, size);
     }
+    *page_link_size(head_index) = size;
+    page_mark_used(head_index, size, ALLOCATOR_PAGE_LINK);
+    set_page_type_data(head_index, ALLOCATOR_PAGE_LINK, PAGE_LINK_HEAD);
+    page_link_mark(head_index + 1, size - 1);
 
-    atomic_fetch_sub(&free_pages, size);
+    page_watermark_check();
     //printf("Allocated %p for size %zi\n", range, size);
-out:
-    SPIN_LOCK_UNLOCK(alloc_lock);
-    //printf("Allocating page link %p of size %zi\n", range, size);
     return range;
 }
 
+void *page_alloc_link(size_t size) {
+    return page_alloc_link_internal(size, PAGE_SIZE, false);
+}
+
+void *page_alloc_link_aligned(size_t size, size_t align) {
+    return page_alloc_link_internal(size, align, false);
+}
+
+// Only the pages of the link that were written to since they were last
+// zeroed get cleared, fresh or purged memory is taken as is
+void *page_alloc_link_zeroed(size_t size) {
+    return page_alloc_link_internal(size, PAGE_SIZE, true);
+}
+
 void page_free_link(void *ptr) {
     if (!ptr)
         return;
 
-    size_t size = 0;
-    size_t index = 0;
-    bool reading_large_size = false;
-    int chunk_index = 0;
+    size_t index = get_page_index(ptr);
+    size_t size = *page_link_size(index);
+    if (!page_mark_free(index, size)) {
+        printf("page_free_link: double free of %p\n", ptr);
+        return;
+    }
 
-    //printf("----------------------\n");
-    while (true) {
-        void* page = (void*)((uintptr_t)ptr + (index * PAGE_SIZE));
-        size_t page_index = get_page_index(page);
-        uint8_t data = get_page_type_data(page_index);
-        uint8_t size_part = type_data_get_data(data);
+    //printf("Freeing page link %p of size %zi\n", ptr, size);
+    if (!quickpool_free_run(ptr, size)) {
+        free_ranges_insert(index, size);
+    }
+    atomic_fetch_add(&free_pages, size);
+}
 
-        if (chunk_index <= MAX_ENCODED_PAGES) {
-            //printf("Getting page data %X for size %zi:%zi page_index: %zi\n", size_part, chunk_index, size, page_index);
-        }
+void *page_realloc_link(void *ptr, size_t new_size) {
+    if (!ptr) {
+        return page_alloc_link(new_size);
+    }
+    if (new_size < 2) {
+        return NULL;
+    }
 
-        if (!reading_large_size) {
-            if (size_part < 0xF) {
-                size = size_part + 2; // 0 represents size 1, 1 represents size 2, ..., 15 represents size 16
-                break;
-            } else {
-                reading_large_size = true;
-            }
-        } else {
-            size |= ((size_t)size_part << (4 * chunk_index));
-            chunk_index++;
+    size_t index = get_page_index(ptr);
+    if (!page_link_head(index)) {
+        printf("page_realloc_link: %p is not the head of a page link\n", ptr);
+        return NULL;
+    }
 
-            if (chunk_index >= MAX_ENCODED_PAGES - 1) {
-                // We've read all the possible chunks for a large size
-                break;
+    size_t size = *page_link_size(index);
+    if (new_size < size) {
+        // Shrink, the tail goes straight back to free_ranges
+        *page_link_size(index) = new_size;
+        page_mark_free(index + new_size, size - new_size);
+        free_ranges_insert(index + new_size, size - new_size);
+        atomic_fetch_add(&free_pages, size - new_size);
+        return ptr;
+    }
+
+    if (new_size > size) {
+        // Grow in place if the pages right behind us are free, the bitmap
+        // rules most of the busy cases out without taking any locks
+        if (page_free_run(index + size, new_size - size) == new_size - size && page_claim(new_size - size, false)) {
+            if (free_ranges_take_at(index + size, new_size - size)) {
+                page_mark_used(index + size, new_size - size, ALLOCATOR_PAGE_LINK);
+                page_link_mark(index + size, new_size - size);
+                *page_link_size(index) = new_size;
+                return ptr;
             }
+            atomic_fetch_add(&free_pages, new_size - size);
         }
 
-        index++;
+        void *new_ptr = page_alloc_link(new_size);
+        if (!new_ptr) {
+            return NULL;
+        }
+
+        __builtin_memcpy(new_ptr, ptr, size * PAGE_SIZE);
+        page_free_link(ptr);
+        return new_ptr;
     }
 
-    //printf("Freeing page link %p of size %zi\n", ptr, size);
-    SPIN_LOCK_LOCK(free_ranges.write_lock);
-    insert_range_sorted(&free_ranges, ptr, get_page_index(ptr), size, true);
-    SPIN_LOCK_UNLOCK(free_ranges.write_lock);
-    atomic_fetch_add(&free_pages, size);
+    return ptr;
 }
 
-void *page_alloc(enum allocator_type type, uint8_t data) {
+size_t page_usable_size(void *ptr) {
+    if (!ptr)
+        return 0;
+
+    size_t  index     = get_page_index(ptr);
+    uint8_t type_data = get_page_type_data(index);
+
+    switch (type_data_get_type(type_data)) {
+        case ALLOCATOR_PAGE: return PAGE_SIZE;
+        case ALLOCATOR_PAGE_LINK:
+            if (type_data_get_data(type_data) == PAGE_LINK_HEAD) {
+                return (size_t)*page_link_size(index) * PAGE_SIZE;
+            }
+            return 0;
+        default: return 0;
+    }
+}
+
+// With reserved set the page was taken out of free_pages by page_reserve()
+// already, everything else claims it once it got hold of one. With zeroed set
+// only pages whose written bit says they might not be zero get cleared.
+static void *page_alloc_internal(enum allocator_type type, uint8_t data, bool reserved, bool zeroed) {
+    // Fast path: our own cpu's cache, free_pages was already settled when it got refilled
+    void* page = page_cache_alloc();
+    if (page) {
+        if (reserved) {
+            // The page the reservation held on to is up for grabs again
+            atomic_fetch_add(&free_pages, 1);
+        }
+        size_t page_index = get_page_index(page);
+        if (zeroed) {
+            page_zero_run(page_index, 1);
+        }
+        page_mark_used(page_index, 1, type);
+        set_page_type_data(page_index, type, data);
+        return page;
+    }
+
     uint8_t tries = 0;
+    uint8_t rounds = 0;
+    bool drained = false;
+    bool reclaimed = false;
+    uint32_t home = free_ranges_home();
 start:
-    void* page = quickpool_alloc(1);
+    page = quickpool_alloc(1, home);
     if (!page) {
-        if (SPIN_LOCK_TRY_LOCK(alloc_lock)) {
-            size_t size = pages / 16;
+        if (SPIN_LOCK_TRY_LOCK(alloc_locks[home])) {
+            size_t size = quickpool_refill_size();
             //size_t size = 1;
-            void* range = skiplist_get_pages(&free_ranges, &size, size - 1, false);
+            void* range = free_ranges_get_pages(&size, size - 1, false);
             if (range) {
-                //void* empty_range = (void*)((uintptr_t)range + PAGE_SIZE);
                 //printf("Got a range of size %zi after %i tries\n", size, tries);
-                for (size_t i = 1; i < size; ++i) {
-                    quickpool_free((void*)((uintptr_t)range + (i * PAGE_SIZE)), 1, 1);
+                if (size > 1) {
+                    quickpool_free((void*)((uintptr_t)range + PAGE_SIZE), 1, size - 1);
                 }
-                //if (size > 1) {
-                //    quickpool_free(empty_range, 1, size - 1);
-                //}
             } else {
                 ++tries;
 
                 // If someone just allocated ahead of us we might have just missed it
                 if (tries < 5) {
-                    SPIN_LOCK_UNLOCK(alloc_lock);
+                    SPIN_LOCK_UNLOCK(alloc_locks[home]);
+                    goto start;
+                }
+
+                // The last free pages might be parked in the cache of another cpu
+                if (!drained) {
+                    SPIN_LOCK_UNLOCK(alloc_locks[home]);
+                    page_cache_drain_all();
+                    drained = true;
+                    tries = 0;
+                    goto start;
+                }
+
+                // Or sit idle in some cache the shrinkers know about
+                if (!reclaimed) {
+                    SPIN_LOCK_UNLOCK(alloc_locks[home]);
+                    page_alloc_reclaim(atomic_load_explicit(&watermark_high, memory_order_relaxed) + 1);
+                    // Whatever got freed went to the cache of this cpu
+                    reclaimed = true;
+                    drained = false;
+                    tries = 0;
+                    goto start;
+                }
+
+                // Out of memory, but the zero pool might still have some
+                range = quickpool_pop(&zero_pool);
+
+                // A reserved page is out there for sure. It might sit in a run pool
+                // or be on its way back from a reclaim another thread is running,
+                // so hand everything back ourselves and look again. Only so many
+                // times though, if the accounting is off the page never turns up.
+                if (!range && reserved) {
+                    SPIN_LOCK_UNLOCK(alloc_locks[home]);
+                    if (rounds >= PAGE_RESERVED_ROUNDS) {
+                        printf("page_alloc_reserved: no page left for the reservation, %zi reserved, %zi free\n",
+                               atomic_load(&reserved_pages), atomic_load(&free_pages));
+                        return NULL;
+                    }
+                    ++rounds;
+                    quickpool_destroy(0);
+                    page_alloc_reclaim(atomic_load_explicit(&watermark_high, memory_order_relaxed) + 1);
+                    DELAY(rounds);
+                    drained = true;
+                    tries = 0;
                     goto start;
                 }
 
@@ -824,33 +3217,308 @@ start:
                 //}
             } 
             page = range;
-            SPIN_LOCK_UNLOCK(alloc_lock);
+            SPIN_LOCK_UNLOCK(alloc_locks[home]);
         } else {
             goto start;
         }
     }
 
+    if (page && !reserved && !page_claim(1, false)) {
+        // Everything left is spoken for by reservations
+        quickpool_free(page, 1, 1);
+        if (!reclaimed) {
+            page_alloc_reclaim(atomic_load_explicit(&watermark_high, memory_order_relaxed) + 1);
+            reclaimed = true;
+            drained = false;
+            tries = 0;
+            goto start;
+        }
+        page = NULL;
+    }
+
     if (page) {
-        atomic_fetch_sub(&free_pages, 1);
         size_t page_index = get_page_index(page);
+        if (zeroed) {
+            page_zero_run(page_index, 1);
+        }
+        page_mark_used(page_index, 1, type);
         set_page_type_data(page_index, type, data);
+        page_watermark_check();
     }
 
     //printf("Allocated page %p\n", page);
     return page;
 }
 
+void *page_alloc(enum allocator_type type, uint8_t data) {
+    return page_alloc_internal(type, data, false, false);
+}
+
+// Bounded mode for real-time threads. Every step is a try lock or a CAS that
+// is given up after PAGE_BOUNDED_TRIES attempts, nothing ever spins, carves
+// free_ranges or reclaims. What it can't get from the cache of this cpu or
+// the quickpools comes from the caller's emergency reserve, the reclaim is
+// left to the next page_alloc_reclaim_poll(). The loops on this path:
+//  - page_cache_get(): one CAS per cpu that shows up for the first time, a
+//    failed one means another cpu raised the count. PAGE_CACHE_CPUS failures
+//    over the life of the process at most.
+//  - the cache owner flag: a single try lock, page_cache_pop() doesn't loop.
+//  - page_try_claim(): PAGE_BOUNDED_TRIES CAS attempts on free_pages.
+//  - the quickpool divisions: QUICKPOOL_DIVISIONS pools, each popped with
+//    PAGE_BOUNDED_TRIES CAS attempts. A tag mismatch is a failed attempt,
+//    the chain walk before it stops after one page.
+//  - page_mark_used() and the reserve's page_bitmap_update(): one page is one
+//    word per bitmap, set or cleared with a single atomic each.
+#define PAGE_BOUNDED_TRIES 4
+
+void *page_alloc_bounded(enum allocator_type type, uint8_t data, page_emergency_t *reserve) {
+    void         *page  = NULL;
+    page_cache_t *cache = page_cache_get();
+    if (SPIN_LOCK_TRY_LOCK(cache->owner)) {
+        page = page_cache_pop(cache);
+        SPIN_LOCK_UNLOCK(cache->owner);
+    }
+
+    // Claimed up front, handing a claim back can't fail where pushing a page back could spin
+    if (!page && page_try_claim(1, false, PAGE_BOUNDED_TRIES)) {
+        uint32_t home = free_ranges_home();
+        for (uint32_t d = 0; !page && d < QUICKPOOL_DIVISIONS; ++d) {
+            pool_t *pool = &quickpools[0].subpool[(home + d) % QUICKPOOL_DIVISIONS];
+            size_t  popped;
+            if (atomic_load_explicit(&pool->size, memory_order_relaxed)) {
+                page = quickpool_try_pop_batch(pool, 1, &popped, PAGE_BOUNDED_TRIES);
+            }
+        }
+        if (!page) {
+            atomic_fetch_add(&free_pages, 1);
+        }
+    }
+
+    if (page) {
+        size_t page_index = get_page_index(page);
+        page_mark_used(page_index, 1, type);
+        set_page_type_data(page_index, type, data);
+    } else if (reserve && reserve->count) {
+        // Handed out as a plain page when the reserve got filled
+        page = reserve->pages[--reserve->count];
+        size_t page_index = get_page_index(page);
+        page_bitmap_update(&page_region(page_index)->types[ALLOCATOR_PAGE], page_index & PAGE_REGION_MASK, 1, false);
+        page_mark_used(page_index, 1, type);
+        set_page_type_data(page_index, type, data);
+    }
+
+    if (!page || atomic_load_explicit(&free_pages, memory_order_relaxed) < atomic_load_explicit(&watermark_low, memory_order_relaxed)) {
+        atomic_store_explicit(&reclaim_pending, true, memory_order_relaxed);
+    }
+    return page;
+}
+
+// Top the reserve up with ordinary allocations, call outside the real-time path
+size_t page_emergency_fill(page_emergency_t *reserve) {
+    size_t added = page_alloc_bulk(ALLOCATOR_PAGE, 0, &reserve->pages[reserve->count], PAGE_EMERGENCY_PAGES - reserve->count);
+    reserve->count += added;
+    return added;
+}
+
+void page_emergency_release(page_emergency_t *reserve) {
+    page_free_bulk(reserve->pages, reserve->count);
+    reserve->count = 0;
+}
+
+// Set aside pages for later page_alloc_reserved() calls without carving
+// anything, the token holds 0 pages if there aren't enough free ones left
+page_reservation_t page_reserve(size_t pages) {
+    page_reservation_t token = {0};
+    if (!pages) {
+        return token;
+    }
+
+    if (!page_claim(pages, false)) {
+        // Cached pages don't count until the reclaim hands them back
+        page_alloc_reclaim(pages + atomic_load_explicit(&watermark_high, memory_order_relaxed));
+        if (!page_claim(pages, false)) {
+            return token;
+        }
+    }
+
+    atomic_fetch_add(&reserved_pages, pages);
+    token.pages = pages;
+    page_watermark_check();
+    return token;
+}
+
+// Can't fail while the token still holds pages, short of broken accounting
+void *page_alloc_reserved(page_reservation_t *token, enum allocator_type type, uint8_t data) {
+    if (!token->pages) {
+        return NULL;
+    }
+
+    void *page = page_alloc_internal(type, data, true, false);
+    if (page) {
+        --token->pages;
+        atomic_fetch_sub(&reserved_pages, 1);
+    }
+    return page;
+}
+
+// Hand back whatever the token still holds
+void page_unreserve(page_reservation_t *token) {
+    if (!token->pages) {
+        return;
+    }
+
+    atomic_fetch_sub(&reserved_pages, token->pages);
+    atomic_fetch_add(&free_pages, token->pages);
+    token->pages = 0;
+}
+
+// Same as page_alloc(), but the page reads as zero. Pages from the zero pool
+// are ready to go, anything else gets cleared unless its written bit is unset.
+void *page_alloc_zeroed(enum allocator_type type, uint8_t data) {
+    void *page = quickpool_pop(&zero_pool);
+    if (page && !page_claim(1, false)) {
+        // Spoken for by reservations, the slow path gets to reclaim first
+        quickpool_push(&zero_pool, page, 1);
+        page = NULL;
+    }
+    if (!page) {
+        return page_alloc_internal(type, data, false, true);
+    }
+
+    size_t page_index = get_page_index(page);
+    page_mark_used(page_index, 1, type);
+    set_page_type_data(page_index, type, data);
+    return page;
+}
+
 void page_free(void *ptr) {
     if (!ptr) {
         return;
     }
 
+    if (!page_mark_free(get_page_index(ptr), 1)) {
+        printf("page_free: double free of %p\n", ptr);
+        return;
+    }
+
+    if (page_cache_free(ptr)) {
+        return;
+    }
+
     //printf("Freeing page %p\n", ptr);
     quickpool_free(ptr, 1, 1);
     //printf("Free: %p\n", ptr);
     atomic_fetch_add(&free_pages, 1);
+    quickpool_coalesce();
     //SPIN_LOCK_LOCK(free_ranges.write_lock);
     //insert_range_sorted(&free_ranges, ptr, get_page_index(ptr), 1, true);
     //SPIN_LOCK_UNLOCK(free_ranges.write_lock);
     //printf("End Free: %p\n", ptr);
 }
+
+size_t page_alloc_bulk(enum allocator_type type, uint8_t data, void **out, size_t n) {
+    size_t count = 0;
+
+    // Whatever our own cpu has cached is already accounted for
+    page_cache_t *cache = page_cache_get();
+    if (SPIN_LOCK_TRY_LOCK(cache->owner)) {
+        void *page;
+        while (count < n && (page = page_cache_pop(cache))) {
+            out[count++] = page;
+        }
+        SPIN_LOCK_UNLOCK(cache->owner);
+    }
+
+    // Then one CAS per division on the quickpools, starting at home
+    size_t   shared = 0;
+    uint32_t home   = free_ranges_home();
+    for (uint32_t d = 0; d < QUICKPOOL_DIVISIONS && count < n; ++d) {
+        size_t popped;
+        void  *page = quickpool_pop_batch(&quickpools[0].subpool[(home + d) % QUICKPOOL_DIVISIONS], n - count, &popped);
+
+        while (page) {
+            out[count++] = page;
+            page         = quickpool_next(page);
+        }
+        shared += popped;
+    }
+    if (shared) {
+        atomic_fetch_add_explicit(&quickpool_pops, shared, memory_order_relaxed);
+    }
+
+    // And carve whatever is left out of free_ranges, normally that is a single range
+    if (count < n) {
+        while (count < n) {
+            size_t size  = n - count;
+            void  *range = free_ranges_get_pages(&size, size - 1, false);
+            if (!range) {
+                break;
+            }
+
+            // The slack may have handed us a whole range rather than leave a sliver, keep the rest around
+            if (size > n - count) {
+                quickpool_free((void*)((uintptr_t)range + ((n - count) * PAGE_SIZE)), 1, size - (n - count));
+                size = n - count;
+            }
+
+            for (size_t i = 0; i < size; ++i) {
+                out[count++] = (void*)((uintptr_t)range + (i * PAGE_SIZE));
+            }
+            shared += size;
+        }
+    }
+
+    if (shared) {
+        // The shared pages come last, hand back what reservations hold on to
+        size_t claimed = page_claim(shared, true);
+        if (claimed < shared) {
+            quickpool_free_pages(&out[count - (shared - claimed)], shared - claimed);
+            count -= shared - claimed;
+        }
+        page_watermark_check();
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        size_t page_index = get_page_index(out[i]);
+        page_mark_used(page_index, 1, type);
+        set_page_type_data(page_index, type, data);
+    }
+
+    return count;
+}
+
+void page_free_bulk(void **ptrs, size_t n) {
+    size_t i = 0;
+
+    // Double frees are rejected by dropping them from the list
+    for (size_t k = 0; k < n; ++k) {
+        if (ptrs[k] && !page_mark_free(get_page_index(ptrs[k]), 1)) {
+            printf("page_free_bulk: double free of %p\n", ptrs[k]);
+            ptrs[k] = NULL;
+        }
+    }
+
+    page_cache_t *cache = page_cache_get();
+    if (SPIN_LOCK_TRY_LOCK(cache->owner)) {
+        for (; i < n; ++i) {
+            if (ptrs[i] && !page_cache_push(cache, ptrs[i])) {
+                break;
+            }
+        }
+        SPIN_LOCK_UNLOCK(cache->owner);
+    }
+
+    // Everything that didn't fit goes to the quickpools
+    size_t total = 0;
+    for (size_t k = i; k < n; ++k) {
+        total += ptrs[k] != NULL;
+    }
+
+    if (!total) {
+        return;
+    }
+
+    atomic_fetch_add(&free_pages, total);
+    quickpool_free_pages(&ptrs[i], n - i);
+    quickpool_coalesce();
+}
@@ -20,6 +20,13 @@
 #define DEALLOC_MIN   0x0BAD         // too far removed fro DEALLOC_VALUE to ever be reached in a race
 #define LOCK_VALUE    (void *)0xCAFE // not page aligned can not happen
 
+// CAS attempts and slab pages slab_alloc_bounded() looks at before it gives up
+#define SLAB_BOUNDED_TRIES 4
+
+// Empty pages per size that stay on the active list for the next allocation,
+// every other page goes back to the page allocator with its last free
+#define SLAB_KEPT_PAGES 1
+
 static uint16_t slab_bytes[]    = {32, 64, 128, 256};
 static uint16_t slab_entries[]  = {126, 63, 31, 15};
 
@@ -34,6 +41,7 @@ typedef struct slab_header {
     atomic_uchar          size;
     atomic_uchar          status;
     atomic_ushort         use_count;
+    atomic_uchar          kept; // Empty and counted in slab_kept
     atomic_uintptr_t      next[SKIP_LIST_MAX_LEVEL];
     atomic_uint_least32_t bitmap[4];
 } slab_header_t;
@@ -66,6 +74,7 @@ static skiplist_t slab_head_inactive[4] = {
     {.head = {0}, .in = SLAB_STATUS_INACTIVE, .out = SLAB_STATUS_DEALLOCATED, .write_lock = ATOMIC_FLAG_INIT}};
 
 // static atomic_uintptr_t         slab_cache[] = {0, 0, 0, 0};
+static atomic_uint_least32_t slab_kept[] = {0, 0, 0, 0}; // Empty pages kept on the active list per size
 static atomic_flag slab_alloc_lock[]   = {ATOMIC_FLAG_INIT, ATOMIC_FLAG_INIT, ATOMIC_FLAG_INIT, ATOMIC_FLAG_INIT};
 
 #ifndef BADGEROS_KERNEL
@@ -76,10 +85,6 @@ static_assert((sizeof(slab_header_t) <= DATA_OFFSET), "Slab header must be small
 
 /* comment so clang-format is happy */
 
-uint8_t is_page_free(void* ptr) {
-    return true;
-}
-
 static inline bool bitmap_get_bit(const uint32_t word, uint8_t bit_index) {
     return (word & ((uint32_t)1 << bit_index)) != 0;
 }
@@ -102,10 +107,18 @@ static void init_slab(slab_header_t *header, const enum slab_sizes size) {
     }
 
     atomic_store_explicit(&header->size, size, memory_order_release);
+    atomic_store_explicit(&header->kept, false, memory_order_release);
     atomic_store_explicit(&header->use_count, 1, memory_order_release);
     atomic_store_explicit(&header->status, SLAB_STATUS_ACTIVE_FULL, memory_order_release);
 }
 
+// The page got its first slot taken again or is about to go away, it no longer counts as kept
+static inline void slab_unkeep(slab_header_t *header) {
+    if (atomic_exchange_explicit(&header->kept, false, memory_order_acq_rel)) {
+        atomic_fetch_sub_explicit(&slab_kept[header->size], 1, memory_order_relaxed);
+    }
+}
+
 static inline uint8_t determine_node_height(void *ptr) {
     uint8_t level = (uint8_t)((((uintptr_t)ptr >> 12) & 0x3) + 1);
     return level;
@@ -133,8 +146,6 @@ static void insert_slab_sorted(skiplist_t *list, slab_header_t *header, bool non
         goto out;
     }
 
-    printf("insert_slab_sorted ptr: %p, nonblock: %i\n", header, nonblock);
-
     // Make sure we don't have any weird pointers on other levels
     for (uint32_t i = 0; i < SKIP_LIST_MAX_LEVEL; ++i) {
         atomic_store_explicit(&header->next[i], 0, memory_order_release);
@@ -162,6 +173,8 @@ static void insert_slab_sorted(skiplist_t *list, slab_header_t *header, bool non
             printf("slab_skip_list: trying to create a loop on level %i %p\n", i, header);
             exit(1);
         }
+        // Link the rest of the list behind us before we become reachable
+        atomic_store_explicit(&header->next[i], (uintptr_t)next, memory_order_relaxed);
         atomic_store_explicit(&update[i]->next[i], (uintptr_t)header, memory_order_release);
     }
 
@@ -246,7 +259,6 @@ static bool remove_slab(skiplist_t *list, slab_header_t *header, bool deleting,
         } while (true);
     }
 
-    printf("remove_slab ptr: %p, nonblock: %i\n", header, nonblock);
     skip_list_remove(list, header);
 
     success = true;
@@ -255,14 +267,17 @@ out:
     return success;
 }
 
-static void *allocate_slab(const enum slab_sizes size) {
+// Bounded allocations take their page without spinning and may fall back on the
+// emergency reserve. If the active list is busy the page serves this allocation
+// only and goes away again once that is freed.
+static void *allocate_slab(const enum slab_sizes size, page_emergency_t *reserve, bool bounded) {
     if (!SPIN_LOCK_TRY_LOCK(slab_alloc_lock[size])) {
         return LOCK_VALUE;
     }
 
     slab_header_t *page = NULL;
     if (!page) {
-        page = page_alloc(ALLOCATOR_SLAB, size);
+        page = bounded ? page_alloc_bounded(ALLOCATOR_SLAB, size, reserve) : page_alloc(ALLOCATOR_SLAB, size);
         if (page) {
             init_slab(page, size);
         }
@@ -274,7 +289,7 @@ static void *allocate_slab(const enum slab_sizes size) {
         return NULL;
     }
 
-    insert_slab_sorted(&slab_head_active[size], page, false);
+    insert_slab_sorted(&slab_head_active[size], page, bounded);
 
 #ifndef BADGEROS_KERNEL
     // printf("allocate_slab(%i) page = %p\n", size, page);
@@ -323,6 +338,7 @@ static void deallocate_slab(void *page) {
     // if (tries > 1) printf("Deallocate_slab(%p) after %i tries\n", page, tries);
 #endif
 
+    slab_unkeep(header);
     SPIN_LOCK_LOCK(slab_alloc_lock[size]);
     // We have to block on this here as after this we may never see the slab again
     remove_slab(&slab_head_active[size], page, true, false);
@@ -332,6 +348,40 @@ static void deallocate_slab(void *page) {
     page_free(page);
 }
 
+// Take the pages on the active list nobody holds a slot on anymore off it. They
+// are chained through next[0] and freed once the list is unlocked again.
+static slab_header_t *trim_list(skiplist_t *list) {
+    slab_header_t *empty = NULL;
+
+    SPIN_LOCK_LOCK(list->write_lock);
+    slab_header_t *current = (slab_header_t *)atomic_load_explicit(&list->head.next[0], memory_order_acquire);
+    while (current) {
+        slab_header_t *next         = (slab_header_t *)atomic_load_explicit(&current->next[0], memory_order_relaxed);
+        uint16_t       expected_use = 0;
+
+        // Same as the last free, whoever gets the use_count to DEALLOC_VALUE owns the page
+        if (atomic_compare_exchange_strong_explicit(
+                &current->use_count,
+                &expected_use,
+                DEALLOC_VALUE,
+                memory_order_acq_rel,
+                memory_order_relaxed
+            )) {
+            slab_unkeep(current);
+            skip_list_remove(list, current);
+            atomic_store_explicit(&current->status, SLAB_STATUS_DEALLOCATED, memory_order_release);
+            atomic_store_explicit(&current->next[0], (uintptr_t)empty, memory_order_relaxed);
+            empty = current;
+        }
+        current = next;
+    }
+    SPIN_LOCK_UNLOCK(list->write_lock);
+
+    return empty;
+}
+
+// Hands the slab pages that aren't in use back to the page allocator, the
+// empty ones kept on the active lists included
 void deallocate_inactive() {
     slab_header_t *page      = NULL;
 
@@ -347,10 +397,18 @@ void deallocate_inactive() {
             }
 
         } while (true);
+
+        page = trim_list(&slab_head_active[size]);
+        while (page) {
+            slab_header_t *next = (slab_header_t *)atomic_load_explicit(&page->next[0], memory_order_relaxed);
+            page_free(page);
+            page = next;
+        }
     }
 }
 
-static inline bool try_get_slab_page(slab_header_t *header, const enum slab_sizes size) {
+static inline bool try_get_slab_page(slab_header_t *header, const enum slab_sizes size, bool bounded) {
+    uint32_t tries = 0;
     uint16_t use_count    = atomic_load_explicit(&header->use_count, memory_order_relaxed);
 
     // We might have raced here, there are some possible scenarios:
@@ -374,28 +432,45 @@ static inline bool try_get_slab_page(slab_header_t *header, const enum slab_size
             memory_order_acq_rel,
             memory_order_relaxed
         )) {
+            if (!use_count) {
+                slab_unkeep(header);
+            }
             return true;
         }
+
+        if (bounded && ++tries >= SLAB_BOUNDED_TRIES) {
+            return false;
+        }
     }
 
     // Slab is full lets stop looking at it, but don't try very hard
     // We don't want to lock if we don't have to, and if we see it as full
     // either we, or someone else will see it too and try as well.
-    remove_slab(&slab_head_active[header->size], header, false, true);
+    if (remove_slab(&slab_head_active[header->size], header, false, true)) {
+        // The last slot might have been freed while it still sat on the list,
+        // nobody else sees it once it's off
+        uint16_t expected_use = 0;
+        if (atomic_compare_exchange_strong(&header->use_count, &expected_use, DEALLOC_VALUE)) {
+            deallocate_slab(header);
+        }
+    }
     return false;
 }
 
-static void *get_slab_page(const enum slab_sizes size, uint32_t tries) {
+static void *get_slab_page(const enum slab_sizes size, uint32_t tries, page_emergency_t *reserve, bool bounded) {
     slab_header_t *page = NULL;
 
 start:
     // Try to get the slab with the lowest address.
     page = (slab_header_t *)atomic_load_explicit(&slab_head_active[size].head.next[0], memory_order_relaxed);
 
-    if (!page || tries > 10) {
+    if (!page || tries > (bounded ? SLAB_BOUNDED_TRIES : 10)) {
         // There are no active pages with space on them
-        page = allocate_slab(size);
+        page = allocate_slab(size, reserve, bounded);
         if (page == LOCK_VALUE) {
+            if (bounded) {
+                return NULL;
+            }
             tries = 0;
             goto start;
         }
@@ -403,14 +478,17 @@ start:
     }
 
     // Try to see if the current page has some space on it still 
-    if (!try_get_slab_page(page, size)) {
+    if (!try_get_slab_page(page, size, bounded)) {
+        if (bounded) {
+            ++tries;
+        }
         goto start;
     }
 
     return page;
 }
 
-void *slab_alloc(size_t size) {
+static void *slab_alloc_internal(size_t size, page_emergency_t *reserve, bool bounded) {
     if (size > 256)
         return NULL;
 
@@ -427,13 +505,14 @@ void *slab_alloc(size_t size) {
 
     uint32_t       tries = 0;
 start_alloc:
-    page = get_slab_page(slab_type, tries);
+    page = get_slab_page(slab_type, tries, reserve, bounded);
     // printf("Got page: %p\n", page);
     if (!page) {
         // printf("slab_alloc: Could not find a page for size %i\n", slab_type);
         return NULL;
     }
 
+    uint32_t races = 0;
     for (uint32_t i = 0; i < BITMAP_WORDS; ++i) {
         uint32_t word = atomic_load_explicit(&page->bitmap[i], memory_order_relaxed);
 
@@ -446,6 +525,9 @@ retry:
 
         if (!atomic_compare_exchange_strong(&page->bitmap[i], &word, desired)) {
             // printf("-");
+            if (bounded && ++races >= SLAB_BOUNDED_TRIES) {
+                break;
+            }
             goto retry;
         }
 
@@ -470,9 +552,22 @@ retry:
     atomic_fetch_sub(&page->use_count, 1);
     // printf(".");
     ++tries;
+    if (bounded && tries >= SLAB_BOUNDED_TRIES) {
+        return NULL;
+    }
     goto start_alloc;
 }
 
+void *slab_alloc(size_t size) {
+    return slab_alloc_internal(size, NULL, false);
+}
+
+// Never spins on a lock and gives up after a fixed number of attempts, for
+// real-time threads. New slab pages may come from the emergency reserve.
+void *slab_alloc_bounded(size_t size, page_emergency_t *reserve) {
+    return slab_alloc_internal(size, reserve, true);
+}
+
 void slab_free(void *ptr) {
     if (!ptr) {
 #ifndef BADGEROS_KERNEL
@@ -549,10 +644,59 @@ void slab_free(void *ptr) {
             memory_order_acq_rel,
             memory_order_relaxed
         )) {
-            deallocate_slab(page);
+            // Up to SLAB_KEPT_PAGES empty pages per size stay on the active list
+            // for the next allocation, deallocate_inactive() hands them back once
+            // memory runs low. The list lock keeps the page from leaving the list
+            // as full while we decide, and the count only ever goes up under it.
+            skiplist_t *list = &slab_head_active[size];
+            bool        keep = false;
+            SPIN_LOCK_LOCK(list->write_lock);
+            if (atomic_load(&header->status) == SLAB_STATUS_ACTIVE &&
+                atomic_load_explicit(&slab_kept[size], memory_order_relaxed) < SLAB_KEPT_PAGES) {
+                atomic_fetch_add_explicit(&slab_kept[size], 1, memory_order_relaxed);
+                atomic_store_explicit(&header->kept, true, memory_order_relaxed);
+                atomic_store_explicit(&header->use_count, 0, memory_order_release);
+                keep = true;
+            }
+            SPIN_LOCK_UNLOCK(list->write_lock);
+
+            if (!keep) {
+                deallocate_slab(page);
+            }
             return;
     }
+}
+
+// Walks the slab pages through the page type bitmaps without taking any slab
+// lock. Pages that are set up or torn down at the same time may be counted
+// with a stale bitmap.
+void slab_stats(slab_stats_t *out) {
+    __builtin_memset(out, 0, sizeof(*out));
+
+    for (int size = 0; size < 4; ++size) {
+        for (size_t index = get_page_index_by_type_data(0, ALLOCATOR_SLAB, size); index != SIZE_MAX;
+             index        = get_page_index_by_type_data(index + 1, ALLOCATOR_SLAB, size)) {
+            slab_header_t *header     = get_page_by_index(index);
+            uint32_t       free_slots = 0;
 
-    // We trust the page allocator to keep low pages for us. We won't
-    // try to reuse slabs that run empty again
+            for (uint32_t i = 0; i < BITMAP_WORDS; ++i) {
+                free_slots += count_set_bits32(atomic_load_explicit(&header->bitmap[i], memory_order_relaxed));
+            }
+            if (free_slots > slab_entries[size]) {
+                free_slots = slab_entries[size];
+            }
+
+            uint32_t used_slots = slab_entries[size] - free_slots;
+            uint32_t bucket     = used_slots * SLAB_STATS_OCCUPANCY_BUCKETS / slab_entries[size];
+            if (bucket >= SLAB_STATS_OCCUPANCY_BUCKETS) {
+                bucket = SLAB_STATS_OCCUPANCY_BUCKETS - 1;
+            }
+
+            ++out->pages[size];
+            out->used_slots[size]          += used_slots;
+            out->free_slots[size]          += free_slots;
+            ++out->occupancy[size][bucket];
+            out->fragmentation_bytes[size] += PAGE_SIZE - used_slots * slab_bytes[size];
+        }
+    }
 }
@@ -93,6 +93,75 @@ static const uint16_t slab_sizes[] = {32, 64, 128, 256};
 
 enum allocator_type { ALLOCATOR_PAGE = 0, ALLOCATOR_SLAB = 1, ALLOCATOR_BUDDY = 2, ALLOCATOR_PAGE_LINK = 3 };
 
+// The head page of a link carries this as its data, the rest of the link carries 0
+#define PAGE_LINK_HEAD 1
+
+#define ALLOCATOR_TYPES (ALLOCATOR_PAGE_LINK + 1)
+
+// How a free range gets picked for an allocation. The policy picks a range
+// within a shard. First fit and keep low try the shards from the lowest
+// address up, the others start at the home shard of the calling cpu.
+enum page_placement {
+    PAGE_PLACEMENT_HYBRID    = 0, // Good fit from the size bins, worst fit from pages / 8 on. The default.
+    PAGE_PLACEMENT_FIRST_FIT = 1, // Lowest address range that fits
+    PAGE_PLACEMENT_BEST_FIT  = 2, // Smallest range that fits without leaving a sliver behind
+    PAGE_PLACEMENT_WORST_FIT = 3, // Largest range
+    PAGE_PLACEMENT_KEEP_LOW  = 4, // Lowest address range that fits, always carved from its front
+};
+
+#define PAGE_PLACEMENTS (PAGE_PLACEMENT_KEEP_LOW + 1)
+
+// Pass to page_alloc_set_purge_decay() to keep every free page
+#define PAGE_PURGE_NEVER SIZE_MAX
+
+// Free runs of 2^i up to 2^(i+1) - 1 pages land in bucket i, the last bucket takes everything longer
+#define PAGE_STATS_RUN_BUCKETS 16
+// Slab pages by the share of their slots in use, in quarters. Full pages land in the last bucket.
+#define SLAB_STATS_OCCUPANCY_BUCKETS 4
+
+// Frees up to pages pages from some cache and returns how many it freed
+typedef size_t (*page_shrinker_t)(void *arg, size_t pages);
+
+typedef struct page_alloc_stats {
+    size_t pages;                              // Pages managed over all regions
+    size_t free_pages;                         // Same as get_free_pages()
+    size_t used_pages;                         // Pages handed out
+    size_t type_pages[ALLOCATOR_TYPES];        // Pages handed out per allocator type
+    size_t cached_pages;                       // Free pages sitting in the per-cpu caches
+    size_t reserved_pages;                     // Free pages held by page_reserve() tokens, not part of free_pages
+    size_t clean_pages;                        // Free pages handed back to the OS, they don't count towards RSS
+    size_t zero_pages;                         // Free pages known to read as zero
+    size_t zero_pool_pages;                    // Free pages zeroed ahead of time for page_alloc_zeroed()
+    size_t quickpool_pages[QUICKPOOL_DIVISIONS];
+    size_t quickpool_run_pages;                // Free pages sitting in the 2 to 16 page run quickpools
+    size_t free_range_pages;                   // Free pages in free_ranges
+    size_t free_runs;                          // Contiguous runs in free_ranges, merged over shard boundaries
+    size_t largest_free_run;
+    size_t free_run_histogram[PAGE_STATS_RUN_BUCKETS];
+} page_alloc_stats_t;
+
+// Pages set aside by page_reserve(), each page_alloc_reserved() takes one
+typedef struct page_reservation {
+    size_t pages; // Pages still held, 0 if the reservation failed or is used up
+} page_reservation_t;
+
+// Pages a real-time thread keeps at hand for the _bounded allocations to fall
+// back on, filled and released outside of the real-time path
+#define PAGE_EMERGENCY_PAGES 16
+
+typedef struct page_emergency {
+    size_t count;
+    void  *pages[PAGE_EMERGENCY_PAGES];
+} page_emergency_t;
+
+typedef struct slab_stats {
+    size_t pages[4];      // Slab pages per size class
+    size_t used_slots[4];
+    size_t free_slots[4];
+    size_t occupancy[4][SLAB_STATS_OCCUPANCY_BUCKETS];
+    size_t fragmentation_bytes[4]; // Bytes of slab pages not holding an object: header, tail and free slots
+} slab_stats_t;
+
 #ifndef BADGEROS_KERNEL
 #include <assert.h>
 
@@ -100,7 +169,11 @@ static_assert((ALLOCATOR_PAGE_LINK < 16), "Allocator type values must fit into 4
 #endif
 
 void         page_alloc_init(void *start, void *end);
+void         page_alloc_init_zeroed(void *start, void *end);
+bool         page_alloc_add_region(void *start, void *end);
+bool         page_alloc_add_zeroed_region(void *start, void *end);
 size_t       get_free_pages();
+size_t       get_used_pages();
 size_t       get_pages();
 bitmap_word *get_page_bitmap();
 size_t       get_page_bitmap_size();
@@ -108,19 +181,45 @@ size_t       get_page_bitmap_size();
 size_t       get_page_index(void *ptr);
 size_t       get_page_index_by_type_data(size_t start_index, enum allocator_type type, uint8_t data);
 void        *get_page_by_index(size_t index);
+bool         is_page_index_valid(size_t index);
 uint8_t      get_page_type(size_t index);
 uint8_t      get_page_data(size_t index);
 size_t       get_largest_size();
+void         page_alloc_stats(page_alloc_stats_t *out);
+void         page_alloc_set_purge_decay(size_t ms);
+bool         page_alloc_set_placement(enum page_placement placement);
+size_t       page_alloc_purge(bool all);
+void         page_alloc_set_zero_pool(size_t pages);
+size_t       page_alloc_prezero(size_t budget);
+bool         page_alloc_set_watermarks(size_t min, size_t low, size_t high);
+bool         page_alloc_register_shrinker(page_shrinker_t shrink, void *arg);
+size_t       page_alloc_reclaim(size_t target);
+size_t       page_alloc_reclaim_poll();
 
 void        *page_alloc(enum allocator_type type, uint8_t data);
+void        *page_alloc_zeroed(enum allocator_type type, uint8_t data);
 void         page_free(void *ptr);
+page_reservation_t page_reserve(size_t pages);
+void        *page_alloc_reserved(page_reservation_t *token, enum allocator_type type, uint8_t data);
+void         page_unreserve(page_reservation_t *token);
+void        *page_alloc_bounded(enum allocator_type type, uint8_t data, page_emergency_t *reserve);
+size_t       page_emergency_fill(page_emergency_t *reserve);
+void         page_emergency_release(page_emergency_t *reserve);
+size_t       page_alloc_bulk(enum allocator_type type, uint8_t data, void **out, size_t n);
+void         page_free_bulk(void **ptrs, size_t n);
 uint8_t      is_page_free(void *ptr);
 
 void        *page_alloc_link(size_t size);
+void        *page_alloc_link_aligned(size_t size, size_t align);
+void        *page_alloc_link_zeroed(size_t size);
 void         page_free_link(void *ptr);
+void        *page_realloc_link(void *ptr, size_t new_size);
+size_t       page_usable_size(void *ptr);
 
 void        *slab_alloc(size_t size);
+void        *slab_alloc_bounded(size_t size, page_emergency_t *reserve);
 void         slab_free(void *ptr);
+void         slab_stats(slab_stats_t *out);
 void         deallocate_inactive();
 void         quickpool_destroy(size_t size);
 void print_size_skiplist();
@@ -0,0 +1,153 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+#include "allocator.h"
+
+#define MEM_SIZE (1024 * 1024 * 128)
+#define NUM_THREADS 32
+#define ITERATIONS 20000
+#define LIVE_PAGES 64
+#define LIVE_SLABS 256
+
+enum latency_op { OP_PAGE_ALLOC, OP_PAGE_FREE, OP_SLAB_ALLOC, OP_SLAB_FREE, OPS };
+static const char* op_names[OPS] = {"page alloc", "page free", "slab alloc", "slab free"};
+
+typedef struct {
+    size_t count[OPS];
+    size_t failed[OPS];
+    size_t total_ns[OPS];
+    size_t max_ns[OPS];
+    size_t emergency_pages;
+} latency_t;
+
+static latency_t latencies[NUM_THREADS];
+static bool bounded = false;
+
+static inline size_t now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (size_t)now.tv_sec * 1000000000 + (size_t)now.tv_nsec;
+}
+
+static inline void record(latency_t* latency, enum latency_op op, size_t begin, bool failed) {
+    size_t took = now_ns() - begin;
+    ++latency->count[op];
+    latency->total_ns[op] += took;
+    latency->failed[op] += failed;
+    if (took > latency->max_ns[op]) {
+        latency->max_ns[op] = took;
+    }
+}
+
+void* thread_work(void* arg) {
+    int thread_num = *((int*) arg);
+    unsigned int seed = thread_num + 1;
+    latency_t* latency = &latencies[thread_num];
+    void* pages[LIVE_PAGES] = {0};
+    void* slabs[LIVE_SLABS] = {0};
+
+    page_emergency_t emergency = {0};
+    if (bounded) {
+        page_emergency_fill(&emergency);
+    }
+
+    for (int i = 0; i < ITERATIONS; ++i) {
+        int slot = rand_r(&seed) % LIVE_PAGES;
+        size_t begin;
+        if (pages[slot]) {
+            begin = now_ns();
+            page_free(pages[slot]);
+            record(latency, OP_PAGE_FREE, begin, false);
+        }
+
+        begin = now_ns();
+        pages[slot] = bounded ? page_alloc_bounded(ALLOCATOR_PAGE, 0, &emergency) : page_alloc(ALLOCATOR_PAGE, 0);
+        record(latency, OP_PAGE_ALLOC, begin, !pages[slot]);
+
+        slot = rand_r(&seed) % LIVE_SLABS;
+        if (slabs[slot]) {
+            begin = now_ns();
+            slab_free(slabs[slot]);
+            record(latency, OP_SLAB_FREE, begin, false);
+        }
+
+        size_t size = slab_sizes[rand_r(&seed) % 4];
+        begin = now_ns();
+        slabs[slot] = bounded ? slab_alloc_bounded(size, &emergency) : slab_alloc(size);
+        record(latency, OP_SLAB_ALLOC, begin, !slabs[slot]);
+
+        // Real-time threads top their reserve up outside of the timed path
+        if (bounded && emergency.count < PAGE_EMERGENCY_PAGES / 2) {
+            latency->emergency_pages += PAGE_EMERGENCY_PAGES - emergency.count;
+            page_emergency_fill(&emergency);
+        }
+    }
+
+    for (int i = 0; i < LIVE_PAGES; ++i) {
+        page_free(pages[i]);
+    }
+    for (int i = 0; i < LIVE_SLABS; ++i) {
+        if (slabs[i]) {
+            slab_free(slabs[i]);
+        }
+    }
+    latency->emergency_pages += PAGE_EMERGENCY_PAGES - emergency.count;
+    page_emergency_release(&emergency);
+
+    return NULL;
+}
+
+static void run(bool bounded_mode) {
+    pthread_t threads[NUM_THREADS];
+    int thread_nums[NUM_THREADS];
+
+    bounded = bounded_mode;
+    for (int i = 0; i < NUM_THREADS; ++i) {
+        thread_nums[i] = i;
+        latencies[i] = (latency_t){0};
+        pthread_create(&threads[i], NULL, thread_work, &thread_nums[i]);
+    }
+
+    latency_t total = {0};
+    for (int i = 0; i < NUM_THREADS; ++i) {
+        pthread_join(threads[i], NULL);
+        for (int op = 0; op < OPS; ++op) {
+            total.count[op] += latencies[i].count[op];
+            total.failed[op] += latencies[i].failed[op];
+            total.total_ns[op] += latencies[i].total_ns[op];
+            if (latencies[i].max_ns[op] > total.max_ns[op]) {
+                total.max_ns[op] = latencies[i].max_ns[op];
+            }
+        }
+        total.emergency_pages += latencies[i].emergency_pages;
+    }
+
+    printf("%s, %i threads:\n", bounded_mode ? "Bounded" : "Default", NUM_THREADS);
+    for (int op = 0; op < OPS; ++op) {
+        printf("  %-10s %9zi ops, avg %6zi ns, worst %9zi ns, %zi failed\n", op_names[op], total.count[op], total.count[op] ? total.total_ns[op] / total.count[op] : 0, total.max_ns[op], total.failed[op]);
+    }
+    if (bounded_mode) {
+        printf("  %zi pages taken from emergency reserves\n", total.emergency_pages);
+    }
+}
+
+int main() {
+    void* start = calloc(MEM_SIZE, 1);
+    void* end = (char*)start + MEM_SIZE;
+    page_alloc_init_zeroed(start, end);
+
+    printf("Worst case latency per operation, %i iterations per thread\n", ITERATIONS);
+    run(false);
+    run(true);
+
+    deallocate_inactive();
+    quickpool_destroy(0);
+    if (get_free_pages() != get_pages()) {
+        printf("Error: Free pages count does not match! Expected %zu, but got %zu\n", get_pages(), get_free_pages());
+        return 1;
+    }
+
+    free(start);
+    return 0;
+}
@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+#include "allocator.h"
+
+#define MEM_SIZE (1024 * 1024 * 128)
+#define MAX_THREADS 32
+#define ITERATIONS 10000
+#define LIVE_LINKS 16
+#define MAX_LINK_PAGES 64
+
+#ifdef SYSTEM_MALLOC
+static inline void* allocate_page_link(size_t num) {
+    return malloc(PAGE_SIZE * num);
+}
+static inline void free_page_link(void* ptr) {
+    free(ptr);
+}
+#else
+static inline void* allocate_page_link(size_t num) {
+    return page_alloc_link(num);
+}
+static inline void free_page_link(void* ptr) {
+    page_free_link(ptr);
+}
+#endif
+
+static size_t failed_allocations[MAX_THREADS];
+
+void* thread_work(void* arg) {
+    int thread_num = *((int*) arg);
+    unsigned int seed = thread_num + 1;
+    void* live[LIVE_LINKS] = {0};
+
+    for (int i = 0; i < ITERATIONS; ++i) {
+        int slot = rand_r(&seed) % LIVE_LINKS;
+        if (live[slot]) {
+            free_page_link(live[slot]);
+        }
+
+        live[slot] = allocate_page_link(2 + rand_r(&seed) % (MAX_LINK_PAGES - 1));
+        if (!live[slot]) {
+            ++failed_allocations[thread_num];
+        }
+    }
+
+    for (int i = 0; i < LIVE_LINKS; ++i) {
+        if (live[i]) {
+            free_page_link(live[i]);
+        }
+    }
+
+    return NULL;
+}
+
+int main() {
+    pthread_t threads[MAX_THREADS];
+    int thread_nums[MAX_THREADS];
+
+#ifndef SYSTEM_MALLOC
+    void* start = calloc(MEM_SIZE, 1);
+    void* end = (char*)start + MEM_SIZE;
+    page_alloc_init_zeroed(start, end);
+#endif
+
+    printf("Link alloc/free scaling, %i iterations per thread, 2-%i pages per link\n", ITERATIONS, MAX_LINK_PAGES);
+    for (int num_threads = 1; num_threads <= MAX_THREADS; num_threads *= 2) {
+        struct timespec begin, finish;
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+
+        for (int i = 0; i < num_threads; ++i) {
+            thread_nums[i] = i;
+            failed_allocations[i] = 0;
+            pthread_create(&threads[i], NULL, thread_work, &thread_nums[i]);
+        }
+
+        size_t failed = 0;
+        for (int i = 0; i < num_threads; ++i) {
+            pthread_join(threads[i], NULL);
+            failed += failed_allocations[i];
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &finish);
+        double seconds = (finish.tv_sec - begin.tv_sec) + (finish.tv_nsec - begin.tv_nsec) / 1e9;
+        double operations = (double)num_threads * ITERATIONS * 2;
+
+        printf("%2i threads: %10.0f ops/s, %8.0f ops/s per thread, %zi failed allocations\n", num_threads, operations / seconds, operations / seconds / num_threads, failed);
+
+#ifndef SYSTEM_MALLOC
+        quickpool_destroy(0);
+        if (get_free_pages() != get_pages()) {
+            printf("Error: Free pages count does not match! Expected %zu, but got %zu\n", get_pages(), get_free_pages());
+            return 1;
+        }
+#endif
+    }
+
+#ifndef SYSTEM_MALLOC
+    free(start);
+#endif
+    return 0;
+}
@@ -301,9 +301,13 @@ int main(int argc, char* argv[]) {
     int thread_nums[NUM_THREADS];
 
 #ifndef SYSTEM_MALLOC
-    void* start = malloc(MEM_SIZE);
+    void* start = calloc(MEM_SIZE, 1);
     void* end = (char*)start + MEM_SIZE;
-    page_alloc_init(start, end);
+    if (argc > 1 && !page_alloc_set_placement(atoi(argv[1]))) {
+        printf("Unknown placement policy %s\n", argv[1]);
+        return 1;
+    }
+    page_alloc_init_zeroed(start, end);
     atomic_store(&lowest_pointer, (size_t)start);
 #endif
 
@@ -4,5 +4,19 @@ bash build-bench.sh
 
 echo "Badge"
 time ./bench-badge
+
+# Placement policies, see enum page_placement
+for policy in 1 2 3 4; do
+	echo "Badge placement ${policy}"
+	time ./bench-badge ${policy}
+done
 echo "System"
 time ./bench-system
+
+echo "Badge link scaling"
+./bench-link-badge
+echo "System link scaling"
+./bench-link-system
+
+echo "Badge worst case latency"
+./bench-latency-badge
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stddef.h>
+
 __attribute__((always_inline)) static inline void intr_pause() {
     #if (defined(__x86_64__) || defined(__i386__))
     __builtin_ia32_pause();
@@ -14,3 +16,24 @@ __attribute__((always_inline)) static inline void intr_pause() {
     #endif
 }
 
+
+// Clear size bytes, a multiple of 64 on an 8 byte boundary, with non-temporal
+// stores where there are any. Memory that won't be read for a while doesn't
+// push anything else out of the cache that way.
+__attribute__((always_inline)) static inline void intr_stream_zero(void *dest, size_t size) {
+    #if (defined(__x86_64__) && defined(__SSE2__))
+    long long *word = dest;
+    for (size_t i = 0; i < size / sizeof(*word); ++i) {
+        __builtin_ia32_movnti64(&word[i], 0);
+    }
+    __builtin_ia32_sfence();
+    #elif (defined(__i386__) && defined(__SSE2__))
+    int *word = dest;
+    for (size_t i = 0; i < size / sizeof(*word); ++i) {
+        __builtin_ia32_movnti(&word[i], 0);
+    }
+    __builtin_ia32_sfence();
+    #else
+    __builtin_memset(dest, 0, size);
+    #endif
+}
@@ -4,6 +4,7 @@
 #include <pthread.h>
 #include <unistd.h>
 #include <time.h>
+#include <sched.h>
 
 #include <signal.h>
 #include <libunwind.h>
@@ -234,6 +235,47 @@ typedef struct slab_header {
     atomic_uint_least32_t status;
 } slab_header_t;
 
+// Stands in for some cache outside the allocator that can give pages back
+static void* user_cache[16];
+static size_t user_cached = 0;
+
+static size_t user_cache_shrink(void* arg, size_t pages) {
+    (void)arg;
+    size_t freed = 0;
+    while (user_cached && freed < pages) {
+        page_free(user_cache[--user_cached]);
+        ++freed;
+    }
+    return freed;
+}
+
+// Hands its links back to the run pools once armed, then holds on to the
+// reclaim that called it until it's told to let go
+enum { LINK_CACHE_IDLE, LINK_CACHE_ARMED, LINK_CACHE_FREED, LINK_CACHE_DONE };
+static void* link_cache[8];
+static atomic_int link_cache_state = LINK_CACHE_IDLE;
+static size_t link_cache_shrink(void* arg, size_t pages) {
+    (void)arg;
+    (void)pages;
+    if (atomic_load(&link_cache_state) != LINK_CACHE_ARMED) {
+        return 0;
+    }
+    for (int i = 0; i < 8; ++i) {
+        page_free_link(link_cache[i]);
+    }
+    atomic_store(&link_cache_state, LINK_CACHE_FREED);
+    while (atomic_load(&link_cache_state) != LINK_CACHE_DONE) {
+        sched_yield();
+    }
+    return 8 * 4;
+}
+
+static void* reclaim_thread(void* arg) {
+    (void)arg;
+    page_alloc_reclaim(SIZE_MAX);
+    return NULL;
+}
+
 int main(int argc, char* argv[]) {
     executable = argv[0];
 
@@ -262,7 +304,7 @@ int main(int argc, char* argv[]) {
         exit(1);
     }
 
-    page_alloc_init(start, end);
+    page_alloc_init_zeroed(start, end);
 
     if (argc == 2) silent = true;
 
@@ -284,13 +326,8 @@ int main(int argc, char* argv[]) {
     deallocate_inactive();
     quickpool_destroy(1);
 
-    uint32_t tries = 10000;
-    while (tries && get_free_pages() != get_pages()) {
-	    --tries;
-    }
-
-    if (get_free_pages() != get_pages()) {
-        printf("Error: Free pages count does not match! Expected %zu, but got %zu, missing %zu (After threads)\n", get_pages(), get_free_pages(), get_pages() - get_free_pages());
+    if (get_used_pages() || get_free_pages() != get_pages()) {
+        printf("Error: Free pages count does not match! Expected %zu, but got %zu, missing %zu, used: %zu (After threads)\n", get_pages(), get_free_pages(), get_pages() - get_free_pages(), get_used_pages());
         print_size_skiplist();
 	for (uint32_t i = 0; i < get_pages(); ++i) {
 	    void* page = get_page_by_index(i);
@@ -376,6 +413,122 @@ int main(int argc, char* argv[]) {
     for (int i = TEST - 1; i >= 0 ; --i) {
 	    slab_free(allocations[i]);
     }
+    // The emptied slab page is kept on its active list until it gets trimmed
+    deallocate_inactive();
+
+    #define BULK 100
+    void* bulk[BULK];
+    if (page_alloc_bulk(ALLOCATOR_PAGE, 0, bulk, BULK) != BULK) {
+	    printf("Bulk allocation failed when it should have succeeded\n");
+	    exit(1);
+    }
+    for (int i = 0; i < BULK; ++i) {
+	    for (int k = i + 1; k < BULK; ++k) {
+		    if (bulk[i] == bulk[k]) {
+			    printf("Duplicate bulk allocation %p\n", bulk[i]);
+			    exit(1);
+		    }
+	    }
+    }
+    page_free_bulk(bulk, BULK);
+
+    static const size_t alignments[] = {64 * 1024, 2 * 1024 * 1024};
+    for (size_t i = 0; i < sizeof(alignments) / sizeof(alignments[0]); ++i) {
+	    void* aligned = page_alloc_link_aligned(5, alignments[i]);
+	    if (!aligned || ((uintptr_t)aligned & (alignments[i] - 1))) {
+		    printf("Aligned link allocation failed for alignment %zi: %p\n", alignments[i], aligned);
+		    exit(1);
+	    }
+	    page_free_link(aligned);
+    }
+
+    void* twice = page_alloc(ALLOCATOR_PAGE, 0);
+    if (is_page_free(twice) || get_used_pages() != 1) {
+	    printf("Allocated page %p is not marked as used, used pages: %zi\n", twice, get_used_pages());
+	    exit(1);
+    }
+    page_free(twice);
+    page_free(twice); // Has to be rejected
+    if (!is_page_free(twice) || get_used_pages() != 0) {
+	    printf("Freed page %p is not marked as free, used pages: %zi\n", twice, get_used_pages());
+	    exit(1);
+    }
+
+    // 16 objects on a fresh 64 byte slab page, which holds 63 of them
+    slab_stats_t slab;
+    slab_stats(&slab);
+    if (slab.pages[SLAB_SIZE_64]) {
+	    printf("Slab size class 64 is not empty before the stats test, %zi pages\n", slab.pages[SLAB_SIZE_64]);
+	    exit(1);
+    }
+    void* objects[16];
+    for (int i = 0; i < 16; ++i) {
+	    objects[i] = slab_alloc(64);
+    }
+    slab_stats(&slab);
+    if (slab.pages[SLAB_SIZE_64] != 1 || slab.used_slots[SLAB_SIZE_64] != 16 || slab.free_slots[SLAB_SIZE_64] != 63 - 16 ||
+        slab.occupancy[SLAB_SIZE_64][1] != 1 || slab.fragmentation_bytes[SLAB_SIZE_64] != PAGE_SIZE - 16 * 64) {
+	    printf("Slab stats are off, pages: %zi, used slots: %zi, free slots: %zi, fragmentation: %zi\n", slab.pages[SLAB_SIZE_64], slab.used_slots[SLAB_SIZE_64], slab.free_slots[SLAB_SIZE_64], slab.fragmentation_bytes[SLAB_SIZE_64]);
+	    exit(1);
+    }
+    for (int i = 0; i < 16; ++i) {
+	    slab_free(objects[i]);
+    }
+
+    // The emptied page stays on the active list, running out of pages has to trim it
+    slab_stats(&slab);
+    if (slab.pages[SLAB_SIZE_64] != 1 || slab.used_slots[SLAB_SIZE_64]) {
+	    printf("Emptied slab page was not kept, pages: %zi, used slots: %zi\n", slab.pages[SLAB_SIZE_64], slab.used_slots[SLAB_SIZE_64]);
+	    exit(1);
+    }
+    size_t trim_expected = get_free_pages() + 1;
+    void** trim_exhaust = malloc(get_pages() * sizeof(void*));
+    size_t trim_exhausted = 0;
+    while ((trim_exhaust[trim_exhausted] = page_alloc(ALLOCATOR_PAGE, 0))) {
+	    ++trim_exhausted;
+    }
+    slab_stats(&slab);
+    if (trim_exhausted != trim_expected || slab.pages[SLAB_SIZE_64]) {
+	    printf("Empty slab page was not trimmed, got %zi of %zi pages, %zi slab pages left\n", trim_exhausted, trim_expected, slab.pages[SLAB_SIZE_64]);
+	    exit(1);
+    }
+    page_free_bulk(trim_exhaust, trim_exhausted);
+    free(trim_exhaust);
+
+    // Only one emptied page per size is kept, the others go back with their last free
+    void* two_pages[2 * 63];
+    for (int i = 0; i < 2 * 63; ++i) {
+	    two_pages[i] = slab_alloc(64);
+    }
+    for (int i = 0; i < 2 * 63; ++i) {
+	    slab_free(two_pages[i]);
+    }
+    slab_stats(&slab);
+    if (slab.pages[SLAB_SIZE_64] != 1) {
+	    printf("Emptied slab pages were kept, %zi pages left\n", slab.pages[SLAB_SIZE_64]);
+	    exit(1);
+    }
+    deallocate_inactive();
+
+    uint8_t* grow = page_alloc_link(8);
+    grow[0] = 0x5A;
+    if (page_realloc_link(grow, 4) != grow || page_usable_size(grow) != 4 * PAGE_SIZE) {
+	    printf("Link shrink did not happen in place\n");
+	    exit(1);
+    }
+    // Hand everything parked in the caches and quickpools back so the pages behind the link are in free_ranges
+    quickpool_destroy(0);
+    for (size_t i = 4; i < 32; ++i) {
+	    if (!is_page_free(grow + i * PAGE_SIZE)) {
+		    printf("Page %zi behind the link is in use, can't grow in place\n", i);
+		    exit(1);
+	    }
+    }
+    if (page_realloc_link(grow, 32) != grow || grow[0] != 0x5A || page_usable_size(grow) != 32 * PAGE_SIZE) {
+	    printf("Link grow did not happen in place\n");
+	    exit(1);
+    }
+    page_free_link(grow);
 
     printf("Allocate link1: %zi\n", get_pages() / 4U - 2);
     void* link1 = page_alloc_link(get_pages() / 4U - 2);
@@ -400,6 +553,38 @@ int main(int argc, char* argv[]) {
     }
 
     printf("link1: %p, link2: %p, link3: %p\n", link1, link2, link3);
+    size_t heads = 0;
+    for (size_t i = get_page_index_by_type_data(0, ALLOCATOR_PAGE_LINK, PAGE_LINK_HEAD); i != SIZE_MAX; i = get_page_index_by_type_data(i + 1, ALLOCATOR_PAGE_LINK, PAGE_LINK_HEAD)) {
+	    void* head = get_page_by_index(i);
+	    if (head != link1 && head != link2 && head != link3) {
+		    printf("Unexpected link head %p\n", head);
+		    exit(1);
+	    }
+	    ++heads;
+    }
+    if (heads != 3) {
+	    printf("Found %zi link heads, expected 3\n", heads);
+	    exit(1);
+    }
+    page_alloc_stats_t stats;
+    page_alloc_stats(&stats);
+    size_t runs = 0;
+    for (int i = 0; i < PAGE_STATS_RUN_BUCKETS; ++i) {
+	    runs += stats.free_run_histogram[i];
+    }
+    if (stats.type_pages[ALLOCATOR_PAGE_LINK] != (get_pages() / 4U - 2) * 2 + get_pages() / 2U - 2 || stats.used_pages < stats.type_pages[ALLOCATOR_PAGE_LINK] || runs != stats.free_runs || stats.largest_free_run > stats.free_range_pages) {
+	    printf("Page stats are off, link pages: %zi, used: %zi, runs: %zi/%zi\n", stats.type_pages[ALLOCATOR_PAGE_LINK], stats.used_pages, runs, stats.free_runs);
+	    exit(1);
+    }
+    // The cached largest run has to agree with walking every range
+    if (get_largest_size() != stats.largest_free_run) {
+	    printf("Largest size %zi does not match the largest free run %zi\n", get_largest_size(), stats.largest_free_run);
+	    exit(1);
+    }
+    if (page_usable_size(link2) != (get_pages() / 2U - 2) * PAGE_SIZE) {
+	    printf("Link2 usable size is %zi, expected %zi\n", page_usable_size(link2), (get_pages() / 2U - 2) * PAGE_SIZE);
+	    exit(1);
+    }
     printf("Free link1:\n");
     page_free_link(link1);
     printf("Free link2:\n");
@@ -420,8 +605,320 @@ int main(int argc, char* argv[]) {
         exit(1);
     }
 
+    page_alloc_stats(&stats);
+    if (stats.free_runs != 1 || stats.largest_free_run != get_pages() || stats.used_pages) {
+	    printf("Page stats are off after freeing everything, runs: %zi, largest: %zi\n", stats.free_runs, stats.largest_free_run);
+	    exit(1);
+    }
+
+    // Only fits across every shard, carved without locking them all up front
+    void* spanning = page_alloc_link(get_pages());
+    if (!spanning || get_free_pages() || get_largest_size()) {
+	    printf("Link across all shards failed: %p, %zi free, largest %zi\n", spanning, get_free_pages(), get_largest_size());
+	    exit(1);
+    }
+    page_free_link(spanning);
+    if (get_largest_size() != get_pages()) {
+	    printf("Link across all shards did not coalesce again, largest %zi\n", get_largest_size());
+	    exit(1);
+    }
+
+    size_t clean = stats.clean_pages;
+    size_t purged = page_alloc_purge(true);
+    page_alloc_stats(&stats);
+#ifdef OFF_PAGE_FREE_LISTS
+    // Nothing of a free range lives on its pages, so all of it can go
+    size_t kept = 0;
+#else
+    size_t kept = 1;
+#endif
+    if (stats.clean_pages < clean + purged || !stats.clean_pages || stats.clean_pages + kept > stats.free_pages) {
+	    printf("Purge is off, purged: %zi, clean pages: %zi\n", purged, stats.clean_pages);
+	    exit(1);
+    }
+    clean = stats.clean_pages;
+    uint8_t* dirty = page_alloc_link(8);
+    memset(dirty, 0xA5, 8 * PAGE_SIZE);
+    page_alloc_stats(&stats);
+    if (stats.clean_pages > clean - 7) {
+	    printf("Pages of a link are still clean after handing it out: %zi of %zi\n", stats.clean_pages, clean);
+	    exit(1);
+    }
+    page_free_link(dirty);
+
+    for (int policy = 0; policy < PAGE_PLACEMENTS; ++policy) {
+	    page_alloc_set_placement(policy);
+	    void* placed = page_alloc_link(8);
+	    if (!placed || (policy == PAGE_PLACEMENT_KEEP_LOW && placed != get_page_by_index(0))) {
+		    printf("Link allocation with placement %i failed: %p\n", policy, placed);
+		    exit(1);
+	    }
+	    page_free_link(placed);
+    }
+    if (page_alloc_set_placement(PAGE_PLACEMENTS) || !page_alloc_set_placement(PAGE_PLACEMENT_HYBRID)) {
+	    printf("Placement policy range check is off\n");
+	    exit(1);
+    }
+
+    // The pages of the link freed above were written to, they have to come back cleared
+    uint8_t* zeroed = page_alloc_link_zeroed(8);
+    for (size_t i = 0; zeroed && i < 8 * PAGE_SIZE; ++i) {
+	    if (zeroed[i]) {
+		    printf("Zeroed link has %x at offset %zi\n", zeroed[i], i);
+		    exit(1);
+	    }
+    }
+    memset(zeroed, 0x5A, 8 * PAGE_SIZE);
+    page_free_link(zeroed);
+
+    page_alloc_set_zero_pool(32);
+    size_t prezeroed = page_alloc_prezero(SIZE_MAX);
+    page_alloc_stats(&stats);
+    if (prezeroed != 32 || stats.zero_pool_pages != 32 || stats.zero_pages < 32 || get_free_pages() != get_pages()) {
+	    printf("Prezeroing is off, added: %zi, zero pool: %zi, zero pages: %zi\n", prezeroed, stats.zero_pool_pages, stats.zero_pages);
+	    exit(1);
+    }
+    uint8_t* zero_page = page_alloc_zeroed(ALLOCATOR_PAGE, 0);
+    for (size_t i = 0; zero_page && i < PAGE_SIZE; ++i) {
+	    if (zero_page[i]) {
+		    printf("Zeroed page has %x at offset %zi\n", zero_page[i], i);
+		    exit(1);
+	    }
+    }
+    page_alloc_stats(&stats);
+    if (!zero_page || stats.zero_pool_pages != 31) {
+	    printf("Zeroed page did not come from the zero pool, %zi left\n", stats.zero_pool_pages);
+	    exit(1);
+    }
+    memset(zero_page, 0x5A, PAGE_SIZE);
+    page_free(zero_page);
+    page_alloc_set_zero_pool(0);
+
+    // Without a zero pool the page written to above comes back, its written bit gets it cleared
+    zero_page = page_alloc_zeroed(ALLOCATOR_PAGE, 0);
+    for (size_t i = 0; zero_page && i < PAGE_SIZE; ++i) {
+	    if (zero_page[i]) {
+		    printf("Zeroed page off the free lists has %x at offset %zi\n", zero_page[i], i);
+		    exit(1);
+	    }
+    }
+    if (!zero_page) {
+	    printf("Zeroed page off the free lists failed\n");
+	    exit(1);
+    }
+    page_free(zero_page);
+
+    // Short links go through the run pools, a freed run comes right back
+    void* short_links[16];
+    for (size_t i = 2; i < 16; ++i) {
+	    short_links[i] = page_alloc_link(i);
+	    if (!short_links[i] || page_usable_size(short_links[i]) != i * PAGE_SIZE) {
+		    printf("Short link of %zi pages failed: %p\n", i, short_links[i]);
+		    exit(1);
+	    }
+	    memset(short_links[i], (int)i, i * PAGE_SIZE);
+    }
+    for (size_t i = 2; i < 16; ++i) {
+	    page_free_link(short_links[i]);
+    }
+    page_alloc_stats(&stats);
+    void* run = page_alloc_link(8);
+    if (!stats.quickpool_run_pages || run != short_links[8]) {
+	    printf("Run pools are off, %zi pages in them, got %p for %p\n", stats.quickpool_run_pages, run, short_links[8]);
+	    exit(1);
+    }
+    page_free_link(run);
+    quickpool_destroy(0);
+    page_alloc_stats(&stats);
+    if (stats.quickpool_run_pages || get_free_pages() != get_pages() || stats.free_range_pages != get_pages()) {
+	    printf("Run pools did not empty, %zi pages left in them\n", stats.quickpool_run_pages);
+	    exit(1);
+    }
+
+    // With the user cache full, running out of memory has to empty it before anything fails
+    page_alloc_register_shrinker(user_cache_shrink, NULL);
+    while (user_cached < 16) {
+	    user_cache[user_cached++] = page_alloc(ALLOCATOR_PAGE, 0);
+    }
+    size_t expected = get_free_pages() + 16;
+    void** exhaust = malloc(get_pages() * sizeof(void*));
+    size_t exhausted = 0;
+    while ((exhaust[exhausted] = page_alloc(ALLOCATOR_PAGE, 0))) {
+	    ++exhausted;
+    }
+    if (exhausted != expected || user_cached) {
+	    printf("Ran out of memory after %zi pages, expected %zi, %zi left in the user cache\n", exhausted, expected, user_cached);
+	    exit(1);
+    }
+    page_free_bulk(exhaust, exhausted);
+    free(exhaust);
+
+    // Going below low only asks for a reclaim, frees leave it to the poll
+    while (user_cached < 4) {
+	    user_cache[user_cached++] = page_alloc(ALLOCATOR_PAGE, 0);
+    }
+    if (page_alloc_set_watermarks(2, 1, 3) || !page_alloc_set_watermarks(0, get_free_pages() + 1, get_pages())) {
+	    printf("Watermark range check is off\n");
+	    exit(1);
+    }
+    quickpool_destroy(0);
+    void* below_low = page_alloc(ALLOCATOR_PAGE, 0);
+    if (user_cached != 4) {
+	    printf("Going below low shrank right away\n");
+	    exit(1);
+    }
+    page_free(below_low);
+    if (user_cached != 4) {
+	    printf("Free after going below low shrank\n");
+	    exit(1);
+    }
+    if (!page_alloc_reclaim_poll() || user_cached || page_alloc_reclaim_poll()) {
+	    printf("Reclaim poll after going below low did not shrink, %zi left in the user cache\n", user_cached);
+	    exit(1);
+    }
+    page_alloc_set_watermarks(0, 0, 0);
+    quickpool_destroy(0);
+
+    // Reserved pages stay out of reach of everyone else until the token hands them out
+    size_t to_reserve = get_free_pages() - 8;
+    page_reservation_t token = page_reserve(to_reserve);
+    page_reservation_t too_much = page_reserve(16);
+    page_alloc_stats(&stats);
+    if (token.pages != to_reserve || too_much.pages || stats.reserved_pages != to_reserve || get_free_pages() != 8) {
+	    printf("Reservation is off, got %zi of %zi, %zi on top, %zi free\n", token.pages, to_reserve, too_much.pages, get_free_pages());
+	    exit(1);
+    }
+    void** reserved = malloc(get_pages() * sizeof(void*));
+    size_t unreserved = 0;
+    while ((reserved[unreserved] = page_alloc(ALLOCATOR_PAGE, 0))) {
+	    ++unreserved;
+    }
+    if (unreserved != 8 || page_alloc_link(2)) {
+	    printf("Allocations reached into reserved pages, got %zi pages\n", unreserved);
+	    exit(1);
+    }
+    for (size_t i = 0; i < to_reserve; ++i) {
+	    reserved[unreserved + i] = page_alloc_reserved(&token, ALLOCATOR_PAGE, 0);
+	    if (!reserved[unreserved + i]) {
+		    printf("Reserved allocation %zi of %zi failed\n", i, to_reserve);
+		    exit(1);
+	    }
+    }
+    if (token.pages || page_alloc_reserved(&token, ALLOCATOR_PAGE, 0)) {
+	    printf("Used up reservation still hands out pages\n");
+	    exit(1);
+    }
+    page_free_bulk(reserved, unreserved + to_reserve);
+    free(reserved);
+    token = page_reserve(4);
+    page_unreserve(&token);
+    quickpool_destroy(0);
+    page_alloc_stats(&stats);
+    if (token.pages || stats.reserved_pages || get_free_pages() != get_pages()) {
+	    printf("Unreserving is off, %zi still reserved, %zi of %zi free\n", stats.reserved_pages, get_free_pages(), get_pages());
+	    exit(1);
+    }
+
+    // Reserved pages parked in the run pools have to turn up while another thread holds on to the reclaim
+    page_alloc_register_shrinker(link_cache_shrink, NULL);
+    for (int i = 0; i < 8; ++i) {
+	    link_cache[i] = page_alloc_link(4);
+    }
+    atomic_store(&link_cache_state, LINK_CACHE_ARMED);
+    pthread_t reclaimer;
+    pthread_create(&reclaimer, NULL, reclaim_thread, NULL);
+    while (atomic_load(&link_cache_state) != LINK_CACHE_FREED) {
+	    sched_yield();
+    }
+    size_t racing = get_free_pages();
+    token = page_reserve(racing);
+    void** racing_pages = malloc(racing * sizeof(void*));
+    for (size_t i = 0; i < racing; ++i) {
+	    racing_pages[i] = page_alloc_reserved(&token, ALLOCATOR_PAGE, 0);
+	    if (!racing_pages[i]) {
+		    printf("Reserved allocation %zi of %zi failed while reclaiming\n", i, racing);
+		    exit(1);
+	    }
+    }
+    // With the accounting off the page is nowhere to be found, that has to fail instead of hang
+    page_reservation_t drifted = { .pages = 1 };
+    if (page_alloc_reserved(&drifted, ALLOCATOR_PAGE, 0) || drifted.pages != 1) {
+	    printf("Reserved allocation without a page left didn't fail\n");
+	    exit(1);
+    }
+    atomic_store(&link_cache_state, LINK_CACHE_DONE);
+    pthread_join(reclaimer, NULL);
+    page_free_bulk(racing_pages, racing);
+    free(racing_pages);
+    quickpool_destroy(0);
+    if (token.pages || get_free_pages() != get_pages()) {
+	    printf("Reservation while reclaiming is off, %zi left on the token, %zi of %zi free\n", token.pages, get_free_pages(), get_pages());
+	    exit(1);
+    }
+
+    // Bounded allocations fail fast once memory runs out, unless the emergency reserve has something
+    page_emergency_t emergency = {0};
+    if (page_emergency_fill(&emergency) != PAGE_EMERGENCY_PAGES) {
+	    printf("Filling the emergency reserve failed, got %zi pages\n", emergency.count);
+	    exit(1);
+    }
+    // Bounded allocations never carve free_ranges, warm the quickpools up first
+    page_free(page_alloc(ALLOCATOR_PAGE, 0));
+    void* bounded = page_alloc_bounded(ALLOCATOR_PAGE, 0, &emergency);
+    if (!bounded || emergency.count != PAGE_EMERGENCY_PAGES) {
+	    printf("Bounded allocation took from the reserve while memory was left: %p\n", bounded);
+	    exit(1);
+    }
+    page_free(bounded);
+    void** rt_exhaust = malloc(get_pages() * sizeof(void*));
+    size_t rt_exhausted = 0;
+    while ((rt_exhaust[rt_exhausted] = page_alloc(ALLOCATOR_PAGE, 0))) {
+	    ++rt_exhausted;
+    }
+    void* rt_page = page_alloc_bounded(ALLOCATOR_PAGE, 0, NULL);
+    void* rt_slab = slab_alloc_bounded(256, &emergency);
+    void* rt_reserve = page_alloc_bounded(ALLOCATOR_PAGE, 0, &emergency);
+    if (rt_page || !rt_slab || !rt_reserve || emergency.count > PAGE_EMERGENCY_PAGES - 1) {
+	    printf("Bounded allocations are off when out of memory: page %p, slab %p, reserve %p, %zi left\n", rt_page, rt_slab, rt_reserve, emergency.count);
+	    exit(1);
+    }
+    slab_free(rt_slab);
+    page_free(rt_reserve);
+    page_free_bulk(rt_exhaust, rt_exhausted);
+    free(rt_exhaust);
+    page_emergency_release(&emergency);
+    deallocate_inactive();
+    quickpool_destroy(0);
+    if (emergency.count || get_free_pages() != get_pages()) {
+	    printf("Emergency reserve did not go back, %zi of %zi free\n", get_free_pages(), get_pages());
+	    exit(1);
+    }
+
+    size_t pages_before = get_pages();
+    void* extra = calloc(MEM_SIZE / 4, 1);
+    if (!page_alloc_add_zeroed_region(extra, (char*)extra + MEM_SIZE / 4) || get_pages() <= pages_before || get_free_pages() != get_pages()) {
+        printf("Error: Adding a region failed, pages: %zu, free pages: %zu\n", get_pages(), get_free_pages());
+        exit(1);
+    }
+
+    // Only fits in the new region
+    void* extra_link = page_alloc_link(get_pages() - pages_before - 2);
+    if (!extra_link) {
+        printf("Link allocation from the added region failed\n");
+        print_size_skiplist();
+        exit(1);
+    }
+    page_free_link(extra_link);
+    quickpool_destroy(0);
+
+    if (get_free_pages() != get_pages()) {
+        printf("Error: Free pages count does not match! Expected %zu, but got %zu (after adding a region)\n", get_pages(), get_free_pages());
+    	exit(1);
+    }
+
     printf("All tests passed.\n");
 
+    free(extra);
     free(start);
     return 0;
 }
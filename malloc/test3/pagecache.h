@@ -0,0 +1,61 @@
+#pragma once
+
+#if defined(__linux__)
+#include <sched.h>
+#else
+int smp_cur_cpu();
+#endif
+
+#define PAGE_CACHE_CPUS  64
+#define PAGE_CACHE_SIZE  64
+#define PAGE_CACHE_BATCH (PAGE_CACHE_SIZE / 2)
+
+// One of these exists per cpu (per hart in the kernel). The owner flag is only
+// ever contended when a thread got migrated in the middle of an operation, in
+// every other case this cache line never leaves the cpu it belongs to.
+typedef struct {
+    atomic_flag   owner;
+    atomic_size_t count; // Only written by the owner, readers just want an estimate
+    void         *pages[PAGE_CACHE_SIZE];
+} __attribute__((aligned(64))) page_cache_t;
+
+/* A comment to unconfuse clang-format */
+
+static inline uint32_t page_cache_cpu() {
+#if defined(__linux__)
+    // glibc serves this from the rseq area of the thread, no syscall needed
+    int cpu = sched_getcpu();
+#else
+    int cpu = smp_cur_cpu();
+#endif
+    if (cpu < 0) {
+        return 0;
+    }
+    return (uint32_t)cpu % PAGE_CACHE_CPUS;
+}
+
+static inline size_t page_cache_count(page_cache_t *cache) {
+    return atomic_load_explicit(&cache->count, memory_order_relaxed);
+}
+
+static inline void *page_cache_pop(page_cache_t *cache) {
+    size_t count = atomic_load_explicit(&cache->count, memory_order_relaxed);
+    if (!count) {
+        return NULL;
+    }
+
+    --count;
+    atomic_store_explicit(&cache->count, count, memory_order_relaxed);
+    return cache->pages[count];
+}
+
+static inline bool page_cache_push(page_cache_t *cache, void *page) {
+    size_t count = atomic_load_explicit(&cache->count, memory_order_relaxed);
+    if (count >= PAGE_CACHE_SIZE) {
+        return false;
+    }
+
+    cache->pages[count] = page;
+    atomic_store_explicit(&cache->count, count + 1, memory_order_relaxed);
+    return true;
+}
@@ -1,14 +1,12 @@
-
-
-extern size_t quickpool_segment_size;
-extern uint8_t* mem_start;
-
 typedef struct quickpool_node {
-  atomic_uintptr_t next;
+  atomic_uintptr_t next; // Page index + 1 of the next page in the pool, 0 ends the chain
 } node_t;
 
+// The head packs a page index and a generation tag into a single word. Every
+// successful CAS bumps the tag, so a page that was popped and pushed back in
+// between our load and our CAS can't fool us into installing a stale next.
 typedef struct {
-  atomic_uintptr_t head;
+  bitmap_word_atomic head;
   atomic_size_t size;
 } pool_t;
 
@@ -16,49 +14,135 @@ typedef struct {
   pool_t subpool[QUICKPOOL_DIVISIONS];
 } quickpool_t;
 
+#if BITMAP_WORD_BITS == 64
+#define QUICKPOOL_INDEX_BITS 32
+#else
+#define QUICKPOOL_INDEX_BITS 20
+#endif
+#define QUICKPOOL_INDEX_MASK (((bitmap_word)1 << QUICKPOOL_INDEX_BITS) - 1)
+
 /* A comment to unconfuse clang-format */
 
-static inline uint32_t quickpool_offset(void* pointer) {
-    size_t offset = (size_t)pointer - (size_t)mem_start;
-    return offset / quickpool_segment_size;
-}
+#ifdef OFF_PAGE_FREE_LISTS
+// Kept in an array next to the page table by alloc-page.c
+static node_t* quickpool_node_off_page(void* page);
 
-static inline void quickpool_push(pool_t* pool, node_t* ptr, size_t numb) {
+static inline node_t* quickpool_node(void* page) {
+    return quickpool_node_off_page(page);
+}
+#else
+static inline node_t* quickpool_node(void* page) {
     // offset node somewhere in the page other than where other structures are
-    node_t* node_head = (void*)((uintptr_t)ptr + PAGE_SIZE / 4);
-    node_t* node_tail = (void*)((uintptr_t)ptr + ((numb - 1) * PAGE_SIZE) + PAGE_SIZE / 4);
+    return (void*)((uintptr_t)page + PAGE_SIZE / 4);
+}
+#endif
 
-    for (size_t i = 0; i < numb ; ++i) {
-        node_t* node = (void*)((uintptr_t)ptr + (i * PAGE_SIZE) + PAGE_SIZE / 4);
-        node_t* node_next = (void*)((uintptr_t)ptr + ((i + 1) * PAGE_SIZE) + PAGE_SIZE / 4);
-        node->next = node_next;
-    }
+static inline size_t quickpool_head_index(bitmap_word head) {
+    return head & QUICKPOOL_INDEX_MASK;
+}
+
+static inline bitmap_word quickpool_head_pack(size_t index, bitmap_word old_head) {
+    bitmap_word tag = (old_head >> QUICKPOOL_INDEX_BITS) + 1;
+    return (tag << QUICKPOOL_INDEX_BITS) | (index & QUICKPOOL_INDEX_MASK);
+}
+
+static inline size_t quickpool_page_to_index(void* page) {
+    return page ? get_page_index(page) + 1 : 0;
+}
+
+static inline void* quickpool_index_to_page(size_t index) {
+    return index ? get_page_by_index(index - 1) : NULL;
+}
+
+static inline void quickpool_link(void* page, void* next_page) {
+    atomic_store_explicit(&quickpool_node(page)->next, quickpool_page_to_index(next_page), memory_order_relaxed);
+}
+
+static inline void* quickpool_next(void* page) {
+    return quickpool_index_to_page(atomic_load_explicit(&quickpool_node(page)->next, memory_order_relaxed));
+}
+
+// Push a chain that was linked up front with quickpool_link(), with a single successful CAS
+static inline void quickpool_push_chain(pool_t* pool, void* first, void* last, size_t numb) {
+    size_t      first_index = quickpool_page_to_index(first);
+    bitmap_word old_head    = atomic_load(&pool->head);
+    bitmap_word new_head;
 
-    node_t* old_head = NULL;
-    old_head = (void*)atomic_load(&pool->head);
     do {
-        atomic_store(&node_tail->next, (uintptr_t)old_head);
-    } while (!atomic_compare_exchange_weak(&pool->head, &old_head, (uintptr_t)node_head));
+        atomic_store_explicit(&quickpool_node(last)->next, quickpool_head_index(old_head), memory_order_relaxed);
+        new_head = quickpool_head_pack(first_index, old_head);
+    } while (!atomic_compare_exchange_weak(&pool->head, &old_head, new_head));
 
     atomic_fetch_add(&pool->size, numb);
 }
 
-static inline void* quickpool_pop(pool_t* pool) {
-    node_t* old_head = NULL;
-    node_t* new_head = NULL;
+static inline void quickpool_push(pool_t* pool, void* ptr, size_t numb) {
+    void* last = (void*)((uintptr_t)ptr + ((numb - 1) * PAGE_SIZE));
+
+    for (size_t i = 0; i + 1 < numb; ++i) {
+        void* page = (void*)((uintptr_t)ptr + (i * PAGE_SIZE));
+        quickpool_link(page, (void*)((uintptr_t)page + PAGE_SIZE));
+    }
+
+    quickpool_push_chain(pool, ptr, last, numb);
+}
+
+// Pop up to numb pages with a single successful CAS. The pages come back as a
+// NULL terminated chain to be walked with quickpool_next(), count gets the length.
+// Gives up after tries failed CAS attempts, 0 keeps trying for as long as it takes.
+static inline void* quickpool_try_pop_batch(pool_t* pool, size_t numb, size_t* count, uint32_t tries) {
+    bitmap_word old_head = atomic_load(&pool->head);
+    bitmap_word new_head;
+    size_t      first_index;
+    size_t      last_index;
+    size_t      popped;
 
-    old_head = (void*)atomic_load(&pool->head);
     do {
-        if (!old_head) {
+        first_index = quickpool_head_index(old_head);
+        if (!first_index) {
+            *count = 0;
             return NULL;
         }
-        new_head = (void*)atomic_load(&old_head->next);
-    } while (!atomic_compare_exchange_weak(&pool->head, &old_head, (uintptr_t)new_head));
 
-    if (old_head) {
-        atomic_fetch_sub(&pool->size, 1);
-    }
+        // If the chain changes underneath us we may read garbage here, it only
+        // has to stay in bounds as the CAS below is bound to fail in that case
+        last_index  = first_index;
+        popped      = 1;
+        size_t next = atomic_load_explicit(&quickpool_node(quickpool_index_to_page(last_index))->next, memory_order_relaxed);
+        while (popped < numb && next && is_page_index_valid(next - 1)) {
+            last_index = next;
+            ++popped;
+            next = atomic_load_explicit(&quickpool_node(quickpool_index_to_page(last_index))->next, memory_order_relaxed);
+        }
 
-    return ALIGN_PAGE_DOWN(old_head);
+        if (next && !is_page_index_valid(next - 1)) {
+            next = 0;
+        }
+        new_head = quickpool_head_pack(next, old_head);
+        if (atomic_compare_exchange_weak(&pool->head, &old_head, new_head)) {
+            break;
+        }
+        if (tries && !--tries) {
+            *count = 0;
+            return NULL;
+        }
+    } while (true);
+
+    atomic_fetch_sub(&pool->size, popped);
+
+    // The chain is ours now, cut it loose from whatever is left in the pool
+    void* last = quickpool_index_to_page(last_index);
+    quickpool_link(last, NULL);
+
+    *count = popped;
+    return quickpool_index_to_page(first_index);
 }
 
+static inline void* quickpool_pop_batch(pool_t* pool, size_t numb, size_t* count) {
+    return quickpool_try_pop_batch(pool, numb, count, 0);
+}
+
+static inline void* quickpool_pop(pool_t* pool) {
+    size_t count;
+    return quickpool_pop_batch(pool, 1, &count);
+}